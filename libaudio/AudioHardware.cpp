@@ -24,6 +24,7 @@
 #include <utils/String8.h>
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <unistd.h>
 #include <sys/ioctl.h>
 #include <sys/types.h>
@@ -31,10 +32,14 @@
 #include <sys/resource.h>
 #include <dlfcn.h>
 #include <fcntl.h>
+#if defined(__ARM_NEON__)
+#include <arm_neon.h>
+#endif
 
 #include "AudioHardware.h"
 #include <media/AudioRecord.h>
 #include <hardware_legacy/power.h>
+#include <cutils/properties.h>
 
 extern "C" {
 #include "alsa_audio.h"
@@ -43,10 +48,6 @@ extern "C" {
 
 namespace android {
 
-const uint32_t AudioHardware::inputSamplingRates[] = {
-        8000, 11025, 16000, 22050, 44100
-};
-
 //  trace driver operations for dump
 //
 #define DRIVER_TRACE
@@ -534,8 +535,7 @@ size_t AudioHardware::getInputBufferSize(uint32_t sampleRate, int format, int ch
         LOGW("getInputBufferSize bad channel count: %d", channelCount);
         return 0;
     }
-    if (sampleRate != 8000 && sampleRate != 11025 && sampleRate != 16000 &&
-            sampleRate != 22050 && sampleRate != 44100) {
+    if (getInputSampleRate(sampleRate) != sampleRate) {
         LOGW("getInputBufferSize bad sample rate: %d", sampleRate);
         return 0;
     }
@@ -763,6 +763,16 @@ struct pcm *AudioHardware::openPcmOut_l()
         }
         unsigned flags = PCM_OUT;
 
+        // write() copies straight into the DMA ring when it can be mapped.
+        // Off by default: the status page can't be mapped on this kernel, so
+        // every write still costs SYNC_PTR ioctls and it has yet to be shown
+        // to beat WRITEI_FRAMES on the device.
+        char value[PROPERTY_VALUE_MAX];
+        property_get("audio.pcm_out.mmap", value, "0");
+        if (atoi(value) != 0) {
+            flags |= PCM_MMAP;
+        }
+
         flags |= (AUDIO_HW_OUT_PERIOD_MULT - 1) << PCM_PERIOD_SZ_SHIFT;
         flags |= (AUDIO_HW_OUT_PERIOD_CNT - PCM_PERIOD_CNT_MIN) << PCM_PERIOD_CNT_SHIFT;
 
@@ -912,18 +922,21 @@ const char *AudioHardware::getInputRouteFromDevice(uint32_t device)
     }
 }
 
+// Any rate in range the DownSampler converts to with few enough filter
+// phases is taken as is. Others are rounded to 100Hz, which always is.
 uint32_t AudioHardware::getInputSampleRate(uint32_t sampleRate)
 {
-    uint32_t i;
-    uint32_t prevDelta;
-    uint32_t delta;
-
-    for (i = 0, prevDelta = 0xFFFFFFFF; i < sizeof(inputSamplingRates)/sizeof(uint32_t); i++, prevDelta = delta) {
-        delta = abs(sampleRate - inputSamplingRates[i]);
-        if (delta > prevDelta) break;
+    if (sampleRate < AUDIO_HW_IN_SAMPLERATE_MIN) {
+        return AUDIO_HW_IN_SAMPLERATE_MIN;
+    }
+    if (sampleRate > AUDIO_HW_IN_SAMPLERATE_MAX) {
+        return AUDIO_HW_IN_SAMPLERATE_MAX;
     }
-    // i is always > 0 here
-    return inputSamplingRates[i-1];
+    if (sampleRate == AUDIO_HW_OUT_SAMPLERATE ||
+            DownSampler::phaseCount(sampleRate) <= DownSampler::MAX_PHASES) {
+        return sampleRate;
+    }
+    return (sampleRate + 50) / 100 * 100;
 }
 
 // getActiveInput_l() must be called with mLock held
@@ -1654,6 +1667,19 @@ status_t AudioHardware::AudioStreamInALSA::setParameters(const String8& keyValue
             mHardware->setInputSource_l((audio_source)value);
             mHardware->closeMixer_l();
 
+            // voice wants the shortest delay, video the best quality
+            if (mDownSampler != NULL) {
+                AudioHardware::DownSampler::Quality quality =
+                        AudioHardware::DownSampler::QUALITY_MEDIUM;
+                if (value == AUDIO_SOURCE_VOICE_COMMUNICATION ||
+                        value == AUDIO_SOURCE_VOICE_RECOGNITION) {
+                    quality = AudioHardware::DownSampler::QUALITY_LOW;
+                } else if (value == AUDIO_SOURCE_CAMCORDER) {
+                    quality = AudioHardware::DownSampler::QUALITY_HIGH;
+                }
+                mDownSampler->setQuality(quality);
+            }
+
             param.remove(String8(AudioParameter::keyInputSource));
         }
 
@@ -1730,21 +1756,11 @@ void AudioHardware::AudioStreamInALSA::releaseBuffer(Buffer* buffer)
 
 size_t AudioHardware::AudioStreamInALSA::getBufferSize(uint32_t sampleRate, int channelCount)
 {
-    size_t ratio;
-
-    switch (sampleRate) {
-    case 8000:
-    case 11025:
-        ratio = 4;
-        break;
-    case 16000:
-    case 22050:
-        ratio = 2;
-        break;
-    case 44100:
-    default:
-        ratio = 1;
-        break;
+    // the largest power of 2 the rate is below the capture rate by
+    size_t ratio = 1;
+
+    while (sampleRate * ratio * 2 <= AUDIO_HW_OUT_SAMPLERATE) {
+        ratio *= 2;
     }
 
     return (AUDIO_HW_IN_PERIOD_SZ*channelCount*sizeof(int16_t)) / ratio ;
@@ -1772,45 +1788,69 @@ void AudioHardware::AudioStreamInALSA::unlock() {
 //  DownSampler
 //------------------------------------------------------------------------------
 
-/*
- * 2.30 fixed point FIR filter coefficients for conversion 44100 -> 22050.
- * (Works equivalently for 22010 -> 11025 or any other halving, of course.)
- *
- * Transition band from about 18 kHz, passband ripple < 0.1 dB,
- * stopband ripple at about -55 dB, linear phase.
- *
- * Design and display in MATLAB or Octave using:
- *
- * filter = fir1(19, 0.5); filter = round(filter * 2**30); freqz(filter * 2**-30);
- */
-static const int32_t filter_22khz_coeff[] = {
-    2089257, 2898328, -5820678, -10484531,
-    19038724, 30542725, -50469415, -81505260,
-    152544464, 478517512, 478517512, 152544464,
-    -81505260, -50469415, 30542725, 19038724,
-    -10484531, -5820678, 2898328, 2089257,
-};
-#define NUM_COEFF_22KHZ (sizeof(filter_22khz_coeff) / sizeof(filter_22khz_coeff[0]))
-#define OVERLAP_22KHZ (NUM_COEFF_22KHZ - 2)
-
 /*
  * Convolution of signals A and reverse(B). (In our case, the filter response
  * is symmetric, so the reversing doesn't matter.)
- * A is taken to be in 0.16 fixed-point, and B is taken to be in 2.30 fixed-point.
+ * A is taken to be in 0.16 fixed-point, and B is taken to be in 2.14 fixed-point.
  * The answer will be in 16.16 fixed-point, unclipped.
  *
- * This function would probably be the prime candidate for SIMD conversion if
- * you want more speed.
+ * With NEON, four taps at a time are multiplied and accumulated into four
+ * 32 bit lanes, which are summed at the end. Integer sums don't depend on
+ * the order they are taken in, so the result is bit exact with the scalar
+ * loop, which also takes the remaining taps.
  */
-int32_t fir_convolve(const int16_t* a, const int32_t* b, int num_samples)
+int32_t fir_convolve(const int16_t* a, const int16_t* b, int num_samples)
 {
         int32_t sum = 1 << 13;
-        for (int i = 0; i < num_samples; ++i) {
-                sum += a[i] * (b[i] >> 16);
+        int i = 0;
+#if defined(__ARM_NEON__)
+        int32x4_t acc = vdupq_n_s32(0);
+        for (; i + 4 <= num_samples; i += 4) {
+                acc = vmlal_s16(acc, vld1_s16(a + i), vld1_s16(b + i));
+        }
+        int32x2_t pair = vadd_s32(vget_low_s32(acc), vget_high_s32(acc));
+        sum += vget_lane_s32(vpadd_s32(pair, pair), 0);
+#endif
+        for (; i < num_samples; ++i) {
+                sum += a[i] * b[i];
         }
         return sum >> 14;
 }
 
+/*
+ * fir_convolve() of both channels of interleaved stereo A at once, into
+ * left and right. With NEON, vld2 splits four frames into a left and a
+ * right vector that are multiplied by the same four taps, and the two
+ * accumulators are reduced pairwise into one vector holding both sums.
+ */
+void fir_convolve_stereo(const int16_t* a, const int16_t* b, int num_samples,
+                         int32_t* left, int32_t* right)
+{
+        int32_t sumLeft = 1 << 13;
+        int32_t sumRight = 1 << 13;
+        int i = 0;
+#if defined(__ARM_NEON__)
+        int32x4_t accLeft = vdupq_n_s32(0);
+        int32x4_t accRight = vdupq_n_s32(0);
+        for (; i + 4 <= num_samples; i += 4) {
+                int16x4x2_t frames = vld2_s16(a + i * 2);
+                int16x4_t coeff = vld1_s16(b + i);
+                accLeft = vmlal_s16(accLeft, frames.val[0], coeff);
+                accRight = vmlal_s16(accRight, frames.val[1], coeff);
+        }
+        int32x2_t sums = vpadd_s32(vadd_s32(vget_low_s32(accLeft), vget_high_s32(accLeft)),
+                                   vadd_s32(vget_low_s32(accRight), vget_high_s32(accRight)));
+        sumLeft += vget_lane_s32(sums, 0);
+        sumRight += vget_lane_s32(sums, 1);
+#endif
+        for (; i < num_samples; ++i) {
+                sumLeft += a[i * 2] * b[i];
+                sumRight += a[i * 2 + 1] * b[i];
+        }
+        *left = sumLeft >> 14;
+        *right = sumRight >> 14;
+}
+
 /* Clip from 16.16 fixed-point to 0.16 fixed-point. */
 int16_t clip(int32_t x)
 {
@@ -1823,159 +1863,228 @@ int16_t clip(int32_t x)
     }
 }
 
-/*
- * Convert a chunk from 44 kHz to 22 kHz. Will update num_samples_in and num_samples_out
- * accordingly, since it may leave input samples in the buffer due to overlap.
- *
- * Input and output are taken to be in 0.16 fixed-point.
- */
-void resample_2_1(int16_t* input, int16_t* output, int* num_samples_in, int* num_samples_out)
+static uint32_t gcd(uint32_t a, uint32_t b)
 {
-    if (*num_samples_in < (int)NUM_COEFF_22KHZ) {
-        *num_samples_out = 0;
-        return;
+    while (b != 0) {
+        uint32_t r = a % b;
+        a = b;
+        b = r;
     }
+    return a;
+}
 
-    int odd_smp = *num_samples_in & 0x1;
-    int num_samples = *num_samples_in - odd_smp - OVERLAP_22KHZ;
-
-    for (int i = 0; i < num_samples; i += 2) {
-            output[i / 2] = clip(fir_convolve(input + i, filter_22khz_coeff, NUM_COEFF_22KHZ));
+/* Zeroth order modified Bessel function of the first kind, for the window. */
+static double bessel_i0(double x)
+{
+    double sum = 1.0;
+    double term = 1.0;
+    for (int k = 1; k < 50 && term > sum * 1e-12; ++k) {
+        term *= (x / (2 * k)) * (x / (2 * k));
+        sum += term;
     }
-
-    memmove(input, input + num_samples, (OVERLAP_22KHZ + odd_smp) * sizeof(*input));
-    *num_samples_out = num_samples / 2;
-    *num_samples_in = OVERLAP_22KHZ + odd_smp;
+    return sum;
 }
 
 /*
- * 2.30 fixed point FIR filter coefficients for conversion 22050 -> 16000,
- * or 11025 -> 8000.
- *
- * Transition band from about 14 kHz, passband ripple < 0.1 dB,
- * stopband ripple at about -50 dB, linear phase.
- *
- * Design and display in MATLAB or Octave using:
- *
- * filter = fir1(23, 16000 / 22050); filter = round(filter * 2**30); freqz(filter * 2**-30);
+ * Transition band, as a fraction of the lower of the two rates, and
+ * stopband attenuation in dB for each quality. The transition band is
+ * centered on the Nyquist frequency of the lower rate, so only what falls
+ * in its upper half aliases, and only into its lower half. The 2.14
+ * coefficients don't get much past 70dB.
  */
-static const int32_t filter_16khz_coeff[] = {
-    2057290, -2973608, 1880478, 4362037,
-    -14639744, 18523609, -1609189, -38502470,
-    78073125, -68353935, -59103896, 617555440,
-    617555440, -59103896, -68353935, 78073125,
-    -38502470, -1609189, 18523609, -14639744,
-    4362037, 1880478, -2973608, 2057290,
+static const struct {
+    double transition;
+    double attenuation;
+} resampler_quality[] = {
+    { 0.2, 50 },    // QUALITY_LOW
+    { 0.1, 65 },    // QUALITY_MEDIUM
+    { 0.05, 70 },   // QUALITY_HIGH
 };
-#define NUM_COEFF_16KHZ (sizeof(filter_16khz_coeff) / sizeof(filter_16khz_coeff[0]))
-#define OVERLAP_16KHZ (NUM_COEFF_16KHZ - 1)
-
-/*
- * Convert a chunk from 22 kHz to 16 kHz. Will update num_samples_in and
- * num_samples_out accordingly, since it may leave input samples in the buffer
- * due to overlap.
- *
- * This implementation is rather ad-hoc; it first low-pass filters the data
- * into a temporary buffer, and then converts chunks of 441 input samples at a
- * time into 320 output samples by simple linear interpolation. A better
- * implementation would use a polyphase filter bank to do these two operations
- * in one step.
- *
- * Input and output are taken to be in 0.16 fixed-point.
- */
 
-#define RESAMPLE_16KHZ_SAMPLES_IN 441
-#define RESAMPLE_16KHZ_SAMPLES_OUT 320
-
-void resample_441_320(int16_t* input, int16_t* output, int* num_samples_in, int* num_samples_out)
+uint32_t AudioHardware::DownSampler::phaseCount(uint32_t outSampleRate)
 {
-    const int num_blocks = (*num_samples_in - OVERLAP_16KHZ) / RESAMPLE_16KHZ_SAMPLES_IN;
-    if (num_blocks < 1) {
-        *num_samples_out = 0;
-        return;
-    }
-
-    for (int i = 0; i < num_blocks; ++i) {
-        uint32_t tmp[RESAMPLE_16KHZ_SAMPLES_IN];
-        for (int j = 0; j < RESAMPLE_16KHZ_SAMPLES_IN; ++j) {
-            tmp[j] = fir_convolve(input + i * RESAMPLE_16KHZ_SAMPLES_IN + j,
-                          filter_16khz_coeff,
-                          NUM_COEFF_16KHZ);
-        }
-
-        const float step_float = (float)RESAMPLE_16KHZ_SAMPLES_IN / (float)RESAMPLE_16KHZ_SAMPLES_OUT;
-        const uint32_t step = (uint32_t)(step_float * 32768.0f + 0.5f);  // 17.15 fixed point
-
-        uint32_t in_sample_num = 0;   // 17.15 fixed point
-        for (int j = 0; j < RESAMPLE_16KHZ_SAMPLES_OUT; ++j, in_sample_num += step) {
-            const uint32_t whole = in_sample_num >> 15;
-            const uint32_t frac = (in_sample_num & 0x7fff);  // 0.15 fixed point
-            const int32_t s1 = tmp[whole];
-            const int32_t s2 = tmp[whole + 1];
-            *output++ = clip(s1 + (((s2 - s1) * (int32_t)frac) >> 15));
-        }
-
-    }
-
-    const int samples_consumed = num_blocks * RESAMPLE_16KHZ_SAMPLES_IN;
-    memmove(input, input + samples_consumed, (*num_samples_in - samples_consumed) * sizeof(*input));
-    *num_samples_in -= samples_consumed;
-    *num_samples_out = RESAMPLE_16KHZ_SAMPLES_OUT * num_blocks;
+    return outSampleRate / gcd(AUDIO_HW_OUT_SAMPLERATE, outSampleRate);
 }
 
-
 AudioHardware::DownSampler::DownSampler(uint32_t outSampleRate,
                                     uint32_t channelCount,
                                     uint32_t frameCount,
-                                    AudioHardware::BufferProvider* provider)
+                                    AudioHardware::BufferProvider* provider,
+                                    Quality quality)
     :  mStatus(NO_INIT), mProvider(provider), mSampleRate(outSampleRate),
-       mChannelCount(channelCount), mFrameCount(frameCount),
-       mInLeft(NULL), mInRight(NULL), mTmpLeft(NULL), mTmpRight(NULL),
-       mTmp2Left(NULL), mTmp2Right(NULL), mOutLeft(NULL), mOutRight(NULL)
+       mChannelCount(channelCount), mFrameCount(frameCount), mQuality(quality),
+       mArena(NULL), mFilter(NULL), mIn(NULL), mPhases(0), mTaps(0),
+       mStepWhole(0), mStepFrac(0)
 
 {
     LOGV("AudioHardware::DownSampler() cstor %p SR %d channels %d frames %d",
          this, mSampleRate, mChannelCount, mFrameCount);
 
-    if (mSampleRate != 8000 && mSampleRate != 11025 && mSampleRate != 16000 &&
-            mSampleRate != 22050) {
+    if (mSampleRate < AUDIO_HW_IN_SAMPLERATE_MIN || mSampleRate > AUDIO_HW_IN_SAMPLERATE_MAX ||
+            phaseCount(mSampleRate) > MAX_PHASES) {
         LOGW("AudioHardware::DownSampler cstor: bad sampling rate: %d", mSampleRate);
         return;
     }
 
-    mInLeft = new int16_t[mFrameCount];
-    mInRight = new int16_t[mFrameCount];
-    mTmpLeft = new int16_t[mFrameCount];
-    mTmpRight = new int16_t[mFrameCount];
-    mTmp2Left = new int16_t[mFrameCount];
-    mTmp2Right = new int16_t[mFrameCount];
-    mOutLeft = new int16_t[mFrameCount];
-    mOutRight = new int16_t[mFrameCount];
+    uint32_t div = gcd(AUDIO_HW_OUT_SAMPLERATE, mSampleRate);
+    uint32_t step = AUDIO_HW_OUT_SAMPLERATE / div;
+    mPhases = mSampleRate / div;
+    mStepWhole = step / mPhases;
+    mStepFrac = step % mPhases;
 
+    if (makeFilter() != NO_ERROR) {
+        return;
+    }
+
+    reset();
     mStatus = NO_ERROR;
 }
 
 AudioHardware::DownSampler::~DownSampler()
 {
-    if (mInLeft) delete[] mInLeft;
-    if (mInRight) delete[] mInRight;
-    if (mTmpLeft) delete[] mTmpLeft;
-    if (mTmpRight) delete[] mTmpRight;
-    if (mTmp2Left) delete[] mTmp2Left;
-    if (mTmp2Right) delete[] mTmp2Right;
-    if (mOutLeft) delete[] mOutLeft;
-    if (mOutRight) delete[] mOutRight;
+    if (mArena) delete[] mArena;
+}
+
+/*
+ * Makes the filter bank for mQuality: a Kaiser windowed sinc low pass with
+ * its cutoff at the Nyquist frequency of the lower rate, cut into mPhases
+ * filters of mTaps taps. Phase p makes the output sample p / mPhases of an
+ * input sample past the middle of its window of mTaps input samples. Each
+ * phase is scaled to exactly unity gain at DC, in 2.14 fixed point.
+ * The bank and the input buffer behind it are allocated together.
+ */
+status_t AudioHardware::DownSampler::makeFilter()
+{
+    double ratio = (double)AUDIO_HW_OUT_SAMPLERATE / mSampleRate;
+    if (ratio < 1.0) {
+        ratio = 1.0;
+    }
+    double cutoff = 0.5 / ratio;    // in cycles per input sample
+    double transition = resampler_quality[mQuality].transition * cutoff * 2;
+    double attenuation = resampler_quality[mQuality].attenuation;
+
+    // Kaiser's estimates of the length and window shape
+    uint32_t taps = (uint32_t)ceil((attenuation - 7.95) / (14.36 * transition));
+    taps = (taps + 3) & ~3;
+    double beta = 0.1102 * (attenuation - 8.7);
+    if (attenuation <= 50) {
+        beta = 0.5842 * pow(attenuation - 21, 0.4) + 0.07886 * (attenuation - 21);
+    }
+
+    // a window of input always fits
+    uint32_t frameCount = mFrameCount < taps * 2 ? taps * 2 : mFrameCount;
+    int16_t *arena = new int16_t[mPhases * taps + frameCount * mChannelCount];
+    if (arena == NULL) {
+        return NO_MEMORY;
+    }
+    int16_t *filter = arena;
+
+    double *coeff = new double[taps];
+    double center = taps / 2 - 1;
+    double i0Beta = bessel_i0(beta);
+
+    for (uint32_t p = 0; p < mPhases; ++p) {
+        int16_t *phase = filter + p * taps;
+        double sum = 0;
+
+        for (uint32_t i = 0; i < taps; ++i) {
+            double x = i - center - (double)p / mPhases;
+            double u = x / (taps / 2);
+            double sinc = x == 0 ? 1.0 : sin(2 * M_PI * cutoff * x) / (2 * M_PI * cutoff * x);
+            double window = u * u < 1.0 ? bessel_i0(beta * sqrt(1.0 - u * u)) / i0Beta : 0;
+            coeff[i] = sinc * window;
+            sum += coeff[i];
+        }
+
+        // the rounding error of each tap is carried into the next, which
+        // moves it up to frequencies the filter stops anyway
+        int32_t total = 0;
+        double error = 0;
+        for (uint32_t i = 0; i < taps; ++i) {
+            double value = coeff[i] * (1 << 14) / sum + error;
+            phase[i] = (int16_t)floor(value + 0.5);
+            error = value - phase[i];
+            total += phase[i];
+        }
+        phase[taps / 2] += (1 << 14) - total;
+    }
+    delete[] coeff;
+
+    if (mArena) delete[] mArena;
+    mArena = arena;
+    mFilter = filter;
+    mIn = filter + mPhases * taps;
+    mTaps = taps;
+    mFrameCount = frameCount;
+
+    LOGV("DownSampler %d -> %d: %d phases of %d taps", AUDIO_HW_OUT_SAMPLERATE,
+         mSampleRate, mPhases, mTaps);
+    return NO_ERROR;
+}
+
+status_t AudioHardware::DownSampler::setQuality(Quality quality)
+{
+    if (mStatus != NO_ERROR) {
+        return mStatus;
+    }
+    if (quality == mQuality) {
+        return NO_ERROR;
+    }
+
+    Quality prev = mQuality;
+    mQuality = quality;
+    if (makeFilter() != NO_ERROR) {
+        mQuality = prev;
+        return NO_MEMORY;
+    }
+
+    reset();
+    return NO_ERROR;
 }
 
 void AudioHardware::DownSampler::reset()
 {
     mInInBuf = 0;
-    mInTmpBuf = 0;
-    mInTmp2Buf = 0;
-    mOutBufPos = 0;
-    mInOutBuf = 0;
+    mInPos = 0;
+    mPhase = 0;
 }
 
+/*
+ * Filters the buffered input into up to frameCount frames of out, for as
+ * long as there is a whole window of input. Returns the number of frames
+ * made, mInPos and mPhase are left at the start of the next window.
+ */
+int AudioHardware::DownSampler::filter(int16_t* out, int frameCount)
+{
+    uint32_t pos = mInPos;
+    uint32_t frac = mPhase;
+    int count = 0;
+
+    while (count < frameCount && pos + mTaps <= (uint32_t)mInInBuf) {
+        const int16_t *coeff = mFilter + frac * mTaps;
+
+        if (mChannelCount == 2) {
+            int32_t left, right;
+            fir_convolve_stereo(mIn + pos * 2, coeff, mTaps, &left, &right);
+            out[count * 2] = clip(left);
+            out[count * 2 + 1] = clip(right);
+        } else {
+            out[count] = clip(fir_convolve(mIn + pos, coeff, mTaps));
+        }
+        count++;
+
+        pos += mStepWhole;
+        frac += mStepFrac;
+        if (frac >= mPhases) {
+            frac -= mPhases;
+            pos++;
+        }
+    }
+
+    mInPos = pos;
+    mPhase = frac;
+    return count;
+}
 
 int AudioHardware::DownSampler::resample(int16_t* out, size_t *outFrameCount)
 {
@@ -1987,39 +2096,23 @@ int AudioHardware::DownSampler::resample(int16_t* out, size_t *outFrameCount)
         return BAD_VALUE;
     }
 
-    int16_t *outLeft = mTmp2Left;
-    int16_t *outRight = mTmp2Left;
-    if (mSampleRate == 22050) {
-        outLeft = mTmpLeft;
-        outRight = mTmpRight;
-    } else if (mSampleRate == 8000){
-        outLeft = mOutLeft;
-        outRight = mOutRight;
-    }
-
     int outFrames = 0;
     int remaingFrames = *outFrameCount;
 
-    if (mInOutBuf) {
-        int frames = (remaingFrames > mInOutBuf) ? mInOutBuf : remaingFrames;
-
-        for (int i = 0; i < frames; ++i) {
-            out[i] = outLeft[mOutBufPos + i];
-        }
-        if (mChannelCount == 2) {
-            for (int i = 0; i < frames; ++i) {
-                out[i * 2] = outLeft[mOutBufPos + i];
-                out[i * 2 + 1] = outRight[mOutBufPos + i];
-            }
-        }
+    // output goes straight to out, input is kept for the next call once
+    // enough has been made
+    while (remaingFrames) {
+        int frames = filter(out + outFrames * mChannelCount, remaingFrames);
         remaingFrames -= frames;
-        mInOutBuf -= frames;
-        mOutBufPos += frames;
         outFrames += frames;
-    }
+        if (remaingFrames == 0) {
+            break;
+        }
 
-    while (remaingFrames) {
-        LOGW_IF((mInOutBuf != 0), "mInOutBuf should be 0 here");
+        // only the start of the next window is kept
+        mInInBuf -= mInPos;
+        memmove(mIn, mIn + mInPos * mChannelCount, mInInBuf * mChannelCount * sizeof(*mIn));
+        mInPos = 0;
 
         AudioHardware::BufferProvider::Buffer buf;
         buf.frameCount =  mFrameCount - mInInBuf;
@@ -2029,103 +2122,10 @@ int AudioHardware::DownSampler::resample(int16_t* out, size_t *outFrameCount)
             return ret;
         }
 
-        for (size_t i = 0; i < buf.frameCount; ++i) {
-            mInLeft[i + mInInBuf] = buf.i16[i];
-        }
-        if (mChannelCount == 2) {
-            for (size_t i = 0; i < buf.frameCount; ++i) {
-                mInLeft[i + mInInBuf] = buf.i16[i * 2];
-                mInRight[i + mInInBuf] = buf.i16[i * 2 + 1];
-            }
-        }
+        memcpy(mIn + mInInBuf * mChannelCount, buf.i16,
+               buf.frameCount * mChannelCount * sizeof(*mIn));
         mInInBuf += buf.frameCount;
         mProvider->releaseBuffer(&buf);
-
-        /* 44010 -> 22050 */
-        {
-            int samples_in_left = mInInBuf;
-            int samples_out_left;
-            resample_2_1(mInLeft, mTmpLeft + mInTmpBuf, &samples_in_left, &samples_out_left);
-
-            if (mChannelCount == 2) {
-                int samples_in_right = mInInBuf;
-                int samples_out_right;
-                resample_2_1(mInRight, mTmpRight + mInTmpBuf, &samples_in_right, &samples_out_right);
-            }
-
-            mInInBuf = samples_in_left;
-            mInTmpBuf += samples_out_left;
-            mInOutBuf = samples_out_left;
-        }
-
-        if (mSampleRate == 11025 || mSampleRate == 8000) {
-            /* 22050 - > 11025 */
-            int samples_in_left = mInTmpBuf;
-            int samples_out_left;
-            resample_2_1(mTmpLeft, mTmp2Left + mInTmp2Buf, &samples_in_left, &samples_out_left);
-
-            if (mChannelCount == 2) {
-                int samples_in_right = mInTmpBuf;
-                int samples_out_right;
-                resample_2_1(mTmpRight, mTmp2Right + mInTmp2Buf, &samples_in_right, &samples_out_right);
-            }
-
-
-            mInTmpBuf = samples_in_left;
-            mInTmp2Buf += samples_out_left;
-            mInOutBuf = samples_out_left;
-
-            if (mSampleRate == 8000) {
-                /* 11025 -> 8000*/
-                int samples_in_left = mInTmp2Buf;
-                int samples_out_left;
-                resample_441_320(mTmp2Left, mOutLeft, &samples_in_left, &samples_out_left);
-
-                if (mChannelCount == 2) {
-                    int samples_in_right = mInTmp2Buf;
-                    int samples_out_right;
-                    resample_441_320(mTmp2Right, mOutRight, &samples_in_right, &samples_out_right);
-                }
-
-                mInTmp2Buf = samples_in_left;
-                mInOutBuf = samples_out_left;
-            } else {
-                mInTmp2Buf = 0;
-            }
-
-        } else if (mSampleRate == 16000) {
-            /* 22050 -> 16000*/
-            int samples_in_left = mInTmpBuf;
-            int samples_out_left;
-            resample_441_320(mTmpLeft, mTmp2Left, &samples_in_left, &samples_out_left);
-
-            if (mChannelCount == 2) {
-                int samples_in_right = mInTmpBuf;
-                int samples_out_right;
-                resample_441_320(mTmpRight, mTmp2Right, &samples_in_right, &samples_out_right);
-            }
-
-            mInTmpBuf = samples_in_left;
-            mInOutBuf = samples_out_left;
-        } else {
-            mInTmpBuf = 0;
-        }
-
-        int frames = (remaingFrames > mInOutBuf) ? mInOutBuf : remaingFrames;
-
-        for (int i = 0; i < frames; ++i) {
-            out[outFrames + i] = outLeft[i];
-        }
-        if (mChannelCount == 2) {
-            for (int i = 0; i < frames; ++i) {
-                out[(outFrames + i) * 2] = outLeft[i];
-                out[(outFrames + i) * 2 + 1] = outRight[i];
-            }
-        }
-        remaingFrames -= frames;
-        outFrames += frames;
-        mOutBufPos = frames;
-        mInOutBuf -= frames;
     }
 
     return 0;
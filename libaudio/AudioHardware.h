@@ -54,6 +54,9 @@ namespace android {
 
 // Default audio input sample rate
 #define AUDIO_HW_IN_SAMPLERATE 8000
+// Range of input sample rates the capture at 44.1kHz can be converted to
+#define AUDIO_HW_IN_SAMPLERATE_MIN 8000
+#define AUDIO_HW_IN_SAMPLERATE_MAX 48000
 // Default audio input channel mask
 #define AUDIO_HW_IN_CHANNELS (AudioSystem::CHANNEL_IN_MONO)
 // Default audio input sample format
@@ -180,7 +183,6 @@ private:
     int             mDriverOp;
 
     static uint32_t         checkInputSampleRate(uint32_t sampleRate);
-    static const uint32_t   inputSamplingRates[];
 
     class AudioStreamOutALSA : public AudioStreamOut, public RefBase
     {
@@ -265,38 +267,63 @@ private:
         virtual void releaseBuffer(Buffer* buffer) = 0;
     };
 
+    // Converts the capture at AUDIO_HW_OUT_SAMPLERATE to any rate with a
+    // polyphase filter, in a single pass.
     class DownSampler {
     public:
+        // Trade-off between passband width, stopband attenuation and the
+        // cost and delay of the filter
+        enum Quality {
+            QUALITY_LOW,        // voice, shortest filter
+            QUALITY_MEDIUM,
+            QUALITY_HIGH,
+        };
+
+        enum {
+            MAX_PHASES = 512,
+        };
+
         DownSampler(uint32_t outSampleRate,
                   uint32_t channelCount,
                   uint32_t frameCount,
-                  BufferProvider* provider);
+                  BufferProvider* provider,
+                  Quality quality = QUALITY_MEDIUM);
 
         virtual ~DownSampler();
 
                 void reset();
                 status_t initCheck() { return mStatus; }
                 int resample(int16_t* out, size_t *outFrameCount);
+                status_t setQuality(Quality quality);
+
+        // number of filter phases needed to convert to outSampleRate
+        static  uint32_t phaseCount(uint32_t outSampleRate);
 
     private:
+                status_t makeFilter();
+                int filter(int16_t* out, int frameCount);
+
         status_t    mStatus;
         BufferProvider* mProvider;
         uint32_t mSampleRate;
         uint32_t mChannelCount;
         uint32_t mFrameCount;
-        int16_t *mInLeft;
-        int16_t *mInRight;
-        int16_t *mTmpLeft;
-        int16_t *mTmpRight;
-        int16_t *mTmp2Left;
-        int16_t *mTmp2Right;
-        int16_t *mOutLeft;
-        int16_t *mOutRight;
+        Quality mQuality;
+        // One allocation holds the filter bank, mPhases filters of mTaps
+        // coefficients in 2.14 fixed point, and mFrameCount frames of
+        // interleaved input. Output frames are mStepWhole + mStepFrac /
+        // mPhases input frames apart, the next one is made from the window
+        // at mInPos with phase mPhase.
+        int16_t *mArena;
+        int16_t *mFilter;
+        int16_t *mIn;
+        uint32_t mPhases;
+        uint32_t mTaps;
+        uint32_t mStepWhole;
+        uint32_t mStepFrac;
+        uint32_t mInPos;
+        uint32_t mPhase;
         int mInInBuf;
-        int mInTmpBuf;
-        int mInTmp2Buf;
-        int mOutBufPos;
-        int mInOutBuf;
     };
 
 
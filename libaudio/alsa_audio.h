@@ -25,6 +25,11 @@ struct pcm;
 #define PCM_STEREO     0x00000000
 #define PCM_MONO       0x01000000
 
+/* transfer through the mapped DMA ring, falls back to read/write
+ * transfers when the driver can't map it
+ */
+#define PCM_MMAP       0x02000000
+
 #define PCM_44100HZ    0x00000000
 #define PCM_48000HZ    0x00100000
 #define PCM_8000HZ     0x00200000
@@ -59,6 +64,31 @@ unsigned pcm_buffer_size(struct pcm *pcm);
 int pcm_write(struct pcm *pcm, void *data, unsigned count);
 int pcm_read(struct pcm *pcm, void *data, unsigned count);
 
+/* Frames that can be written (playback) or read (capture) without
+ * blocking, and frames queued between the application and the hardware,
+ * for PCM_MMAP streams.  Read from the mapped status page where the
+ * kernel allows it, otherwise through one SYNC_PTR ioctl.  Return -EPIPE
+ * after an xrun and -EINVAL on read/write streams.
+ */
+int pcm_avail(struct pcm *pcm);
+int pcm_delay(struct pcm *pcm);
+
+/* Waits up to timeout ms for pcm_avail() to become non-zero.
+ * Returns 1 when ready, 0 on timeout and -EPIPE after an xrun.
+ */
+int pcm_wait(struct pcm *pcm, int timeout);
+
+/* Direct access to the DMA ring of a PCM_MMAP stream.  pcm_mmap_begin()
+ * prepares the stream if needed, points data at the next frame and trims
+ * frames to what can be transferred in one contiguous piece, possibly 0
+ * (see pcm_wait()).  It returns -EPIPE after an xrun, the stream restarts
+ * on the next call.  pcm_mmap_commit() hands that many frames to the
+ * hardware, or back to it for capture, and starts playback once the ring
+ * is full.
+ */
+int pcm_mmap_begin(struct pcm *pcm, void **data, unsigned *frames);
+int pcm_mmap_commit(struct pcm *pcm, unsigned frames);
+
 struct mixer;
 struct mixer_ctl;
 
@@ -25,6 +25,8 @@
 #include <stdarg.h>
 #include <string.h>
 #include <errno.h>
+#include <limits.h>
+#include <poll.h>
 #include <unistd.h>
 
 #include <sys/ioctl.h>
@@ -190,12 +192,23 @@ static void info_dump(struct snd_pcm_info *info) {}
 
 #define PCM_ERROR_MAX 128
 
+/* how long a transfer waits on the ring before giving up */
+#define PCM_WAIT_TIMEOUT_MS 1000
+
 struct pcm {
     int fd;
     unsigned flags;
     int running:1;
     int underruns;
     unsigned buffer_size;
+    unsigned boundary;
+    void *mmap_buffer;
+    struct snd_pcm_mmap_status *mmap_status;
+    struct snd_pcm_mmap_control *mmap_control;
+    /* stands in for the status and control pages when the kernel won't
+     * map them, as on ARM where they aren't cache coherent.
+     */
+    struct snd_pcm_sync_ptr *sync_ptr;
     char error[PCM_ERROR_MAX];
 };
 
@@ -225,12 +238,274 @@ static int oops(struct pcm *pcm, int e, const char *fmt, ...)
     return -1;
 }
 
+static inline unsigned pcm_frame_size(struct pcm *pcm)
+{
+    return (pcm->flags & PCM_MONO) ? 2 : 4;
+}
+
+/* exchanges the stream pointers with the kernel, see SNDRV_PCM_SYNC_PTR_*.
+ * a no-op when the status and control pages are mapped.
+ */
+static int pcm_sync_ptr(struct pcm *pcm, int flags)
+{
+    if (!pcm->sync_ptr)
+        return 0;
+
+    pcm->sync_ptr->flags = flags;
+    if (ioctl(pcm->fd, SNDRV_PCM_IOCTL_SYNC_PTR, pcm->sync_ptr))
+        return -errno;
+    return 0;
+}
+
+static int pcm_map_status(struct pcm *pcm)
+{
+    long page_size = sysconf(_SC_PAGE_SIZE);
+    void *p;
+
+    p = mmap(NULL, page_size, PROT_READ, MAP_FILE | MAP_SHARED,
+             pcm->fd, SNDRV_PCM_MMAP_OFFSET_STATUS);
+    if (p != MAP_FAILED) {
+        pcm->mmap_status = p;
+        p = mmap(NULL, page_size, PROT_READ | PROT_WRITE, MAP_FILE | MAP_SHARED,
+                 pcm->fd, SNDRV_PCM_MMAP_OFFSET_CONTROL);
+        if (p != MAP_FAILED) {
+            pcm->mmap_control = p;
+            pcm->mmap_control->avail_min = 1;
+            return 0;
+        }
+        munmap(pcm->mmap_status, page_size);
+        pcm->mmap_status = NULL;
+    }
+
+    LOGV("pcm_open() status page not mappable, using SYNC_PTR");
+    pcm->sync_ptr = calloc(1, sizeof(struct snd_pcm_sync_ptr));
+    if (!pcm->sync_ptr)
+        return oops(pcm, ENOMEM, "cannot allocate sync_ptr");
+    pcm->mmap_status = &pcm->sync_ptr->s.status;
+    pcm->mmap_control = &pcm->sync_ptr->c.control;
+    pcm->mmap_control->avail_min = 1;
+    if (pcm_sync_ptr(pcm, SNDRV_PCM_SYNC_PTR_APPL))
+        return oops(pcm, errno, "cannot sync stream position");
+    return 0;
+}
+
+static void pcm_unmap(struct pcm *pcm)
+{
+    long page_size = sysconf(_SC_PAGE_SIZE);
+
+    if (pcm->mmap_buffer)
+        munmap(pcm->mmap_buffer, pcm->buffer_size * pcm_frame_size(pcm));
+    if (pcm->sync_ptr) {
+        free(pcm->sync_ptr);
+    } else {
+        if (pcm->mmap_status)
+            munmap(pcm->mmap_status, page_size);
+        if (pcm->mmap_control)
+            munmap(pcm->mmap_control, page_size);
+    }
+    pcm->mmap_buffer = NULL;
+    pcm->mmap_status = NULL;
+    pcm->mmap_control = NULL;
+    pcm->sync_ptr = NULL;
+}
+
+/* frames that can be transferred without waiting, from the last known
+ * hardware pointer
+ */
+static int pcm_mmap_avail(struct pcm *pcm)
+{
+    int avail;
+
+    avail = pcm->mmap_status->hw_ptr - pcm->mmap_control->appl_ptr;
+    if (!(pcm->flags & PCM_IN))
+        avail += pcm->buffer_size;
+    if (avail < 0)
+        avail += pcm->boundary;
+    else if (avail >= (int) pcm->boundary)
+        avail -= pcm->boundary;
+    return avail;
+}
+
+int pcm_avail(struct pcm *pcm)
+{
+    int ret;
+
+    if (!(pcm->flags & PCM_MMAP))
+        return -EINVAL;
+    ret = pcm_sync_ptr(pcm, SNDRV_PCM_SYNC_PTR_HWSYNC);
+    if (ret)
+        return ret;
+    if (pcm->mmap_status->state == SNDRV_PCM_STATE_XRUN)
+        return -EPIPE;
+    return pcm_mmap_avail(pcm);
+}
+
+int pcm_delay(struct pcm *pcm)
+{
+    int avail = pcm_avail(pcm);
+
+    if (avail < 0 || (pcm->flags & PCM_IN))
+        return avail;
+    return pcm->buffer_size - avail;
+}
+
+int pcm_wait(struct pcm *pcm, int timeout)
+{
+    struct pollfd pfd;
+    int ret;
+
+    pfd.fd = pcm->fd;
+    pfd.events = (pcm->flags & PCM_IN) ? POLLIN : POLLOUT;
+
+    do {
+        ret = poll(&pfd, 1, timeout);
+    } while (ret < 0 && errno == EINTR);
+
+    if (ret < 0)
+        return -errno;
+    if (ret && (pfd.revents & (POLLERR | POLLNVAL)))
+        return -EPIPE;
+    return ret;
+}
+
+int pcm_mmap_begin(struct pcm *pcm, void **data, unsigned *frames)
+{
+    unsigned offset;
+    int avail;
+
+    if (!(pcm->flags & PCM_MMAP))
+        return -EINVAL;
+
+    if (!pcm->running) {
+        if (ioctl(pcm->fd, SNDRV_PCM_IOCTL_PREPARE))
+            return oops(pcm, errno, "cannot prepare channel");
+        /* prepare rewinds both pointers */
+        if (pcm_sync_ptr(pcm, SNDRV_PCM_SYNC_PTR_APPL))
+            return oops(pcm, errno, "cannot sync stream position");
+        if ((pcm->flags & PCM_IN) && ioctl(pcm->fd, SNDRV_PCM_IOCTL_START))
+            return oops(pcm, errno, "cannot start channel");
+        pcm->running = 1;
+    }
+
+    /* the hardware pointer only moves on, so the last known one is good
+     * enough unless it leaves too little room
+     */
+    avail = pcm_mmap_avail(pcm);
+    if (avail < (int) *frames ||
+        pcm->mmap_status->state == SNDRV_PCM_STATE_XRUN)
+        avail = pcm_avail(pcm);
+    if (avail < 0) {
+        pcm->running = 0;
+        if (avail == -EPIPE) {
+                /* we failed to make our window -- restart on the next call */
+            pcm->underruns++;
+            return -EPIPE;
+        }
+        return oops(pcm, -avail, "cannot sync stream position");
+    }
+
+    offset = pcm->mmap_control->appl_ptr % pcm->buffer_size;
+    if (avail > (int) pcm->buffer_size)
+        avail = pcm->buffer_size;
+    if (*frames > (unsigned) avail)
+        *frames = avail;
+    if (*frames > pcm->buffer_size - offset)
+        *frames = pcm->buffer_size - offset;
+
+    *data = (char *) pcm->mmap_buffer + offset * pcm_frame_size(pcm);
+    return 0;
+}
+
+/* moves the application pointer on.  without push the kernel only learns
+ * of it on the next sync, which saves an ioctl per piece when the status
+ * page isn't mapped.
+ */
+static int pcm_mmap_advance(struct pcm *pcm, unsigned frames, int push)
+{
+    unsigned appl_ptr;
+
+    appl_ptr = pcm->mmap_control->appl_ptr + frames;
+    if (appl_ptr >= pcm->boundary)
+        appl_ptr -= pcm->boundary;
+    pcm->mmap_control->appl_ptr = appl_ptr;
+
+    /* the kernel only applies start_threshold to read/write, so playback
+     * is started here once the ring has been filled
+     */
+    if (!(pcm->flags & PCM_IN) &&
+        pcm->mmap_status->state == SNDRV_PCM_STATE_PREPARED &&
+        pcm_mmap_avail(pcm) == 0) {
+        if (pcm_sync_ptr(pcm, 0))
+            return oops(pcm, errno, "cannot commit stream data");
+        if (ioctl(pcm->fd, SNDRV_PCM_IOCTL_START))
+            return oops(pcm, errno, "cannot start channel");
+        return 0;
+    }
+
+    if (push && pcm_sync_ptr(pcm, 0))
+        return oops(pcm, errno, "cannot commit stream data");
+    return 0;
+}
+
+int pcm_mmap_commit(struct pcm *pcm, unsigned frames)
+{
+    if (!(pcm->flags & PCM_MMAP))
+        return -EINVAL;
+    return pcm_mmap_advance(pcm, frames, 1);
+}
+
+/* pcm_write()/pcm_read() on a mapped ring: one copy between data and the
+ * DMA buffer, the kernel is only entered to wait for room or data.
+ */
+static int pcm_mmap_transfer(struct pcm *pcm, void *data, unsigned count)
+{
+    char *p = data;
+    unsigned frame_size = pcm_frame_size(pcm);
+    unsigned frames = count / frame_size;
+
+    while (frames) {
+        void *buf;
+        unsigned n = frames;
+        int ret;
+
+        ret = pcm_mmap_begin(pcm, &buf, &n);
+        if (ret == -EPIPE)
+            continue;
+        if (ret)
+            return ret;
+        if (n == 0) {
+            ret = pcm_wait(pcm, PCM_WAIT_TIMEOUT_MS);
+            if (ret == 0)
+                return oops(pcm, ETIMEDOUT, "timed out waiting for stream");
+            if (ret < 0 && ret != -EPIPE)
+                return oops(pcm, -ret, "cannot wait for stream");
+            /* an xrun shows up in the next pcm_mmap_begin() */
+            continue;
+        }
+
+        if (pcm->flags & PCM_IN)
+            memcpy(p, buf, n * frame_size);
+        else
+            memcpy(buf, p, n * frame_size);
+        /* pcm_mmap_begin() syncs before any wait, so the pointer only
+         * has to be handed in once the whole transfer is done
+         */
+        if (pcm_mmap_advance(pcm, n, frames == n))
+            return -1;
+        p += n * frame_size;
+        frames -= n;
+    }
+    return 0;
+}
+
 int pcm_write(struct pcm *pcm, void *data, unsigned count)
 {
     struct snd_xferi x;
 
     if (pcm->flags & PCM_IN)
         return -EINVAL;
+    if (pcm->flags & PCM_MMAP)
+        return pcm_mmap_transfer(pcm, data, count);
 
     x.buf = data;
     x.frames = (pcm->flags & PCM_MONO) ? (count / 2) : (count / 4);
@@ -263,6 +538,8 @@ int pcm_read(struct pcm *pcm, void *data, unsigned count)
 
     if (!(pcm->flags & PCM_IN))
         return -EINVAL;
+    if (pcm->flags & PCM_MMAP)
+        return pcm_mmap_transfer(pcm, data, count);
 
     x.buf = data;
     x.frames = (pcm->flags & PCM_MONO) ? (count / 2) : (count / 4);
@@ -290,6 +567,51 @@ int pcm_read(struct pcm *pcm, void *data, unsigned count)
     }
 }
 
+static int pcm_set_hw_params(struct pcm *pcm, unsigned access,
+                             unsigned period_sz, unsigned period_cnt)
+{
+    struct snd_pcm_hw_params params;
+    unsigned flags = pcm->flags;
+
+    param_init(&params);
+    param_set_mask(&params, SNDRV_PCM_HW_PARAM_ACCESS, access);
+    param_set_mask(&params, SNDRV_PCM_HW_PARAM_FORMAT,
+                   SNDRV_PCM_FORMAT_S16_LE);
+    param_set_mask(&params, SNDRV_PCM_HW_PARAM_SUBFORMAT,
+                   SNDRV_PCM_SUBFORMAT_STD);
+    param_set_min(&params, SNDRV_PCM_HW_PARAM_PERIOD_SIZE, period_sz);
+    param_set_int(&params, SNDRV_PCM_HW_PARAM_SAMPLE_BITS, 16);
+    param_set_int(&params, SNDRV_PCM_HW_PARAM_FRAME_BITS,
+                  (flags & PCM_MONO) ? 16 : 32);
+    param_set_int(&params, SNDRV_PCM_HW_PARAM_CHANNELS,
+                  (flags & PCM_MONO) ? 1 : 2);
+    param_set_int(&params, SNDRV_PCM_HW_PARAM_PERIODS, period_cnt);
+    param_set_int(&params, SNDRV_PCM_HW_PARAM_RATE, 44100);
+
+    if (ioctl(pcm->fd, SNDRV_PCM_IOCTL_HW_PARAMS, &params))
+        return oops(pcm, errno, "cannot set hw params");
+    param_dump(&params);
+
+    /* the period size is only a minimum, take the ring the driver chose */
+    pcm->buffer_size = param_to_interval(&params,
+                                         SNDRV_PCM_HW_PARAM_BUFFER_SIZE)->min;
+    return 0;
+}
+
+/* maps the DMA ring of a stream set up for mmap access */
+static int pcm_map_buffer(struct pcm *pcm)
+{
+    void *p;
+
+    p = mmap(NULL, pcm->buffer_size * pcm_frame_size(pcm),
+             PROT_READ | PROT_WRITE, MAP_FILE | MAP_SHARED,
+             pcm->fd, SNDRV_PCM_MMAP_OFFSET_DATA);
+    if (p == MAP_FAILED)
+        return oops(pcm, errno, "cannot map dma buffer");
+    pcm->mmap_buffer = p;
+    return 0;
+}
+
 static struct pcm bad_pcm = {
     .fd = -1,
 };
@@ -299,6 +621,7 @@ int pcm_close(struct pcm *pcm)
     if (pcm == &bad_pcm)
         return 0;
 
+    pcm_unmap(pcm);
     if (pcm->fd >= 0)
         close(pcm->fd);
     pcm->running = 0;
@@ -312,7 +635,6 @@ struct pcm *pcm_open(unsigned flags)
     const char *dname;
     struct pcm *pcm;
     struct snd_pcm_info info;
-    struct snd_pcm_hw_params params;
     struct snd_pcm_sw_params sparams;
     unsigned period_sz;
     unsigned period_cnt;
@@ -352,48 +674,64 @@ struct pcm *pcm_open(unsigned flags)
     LOGV("pcm_open() period_cnt %d period_sz %d channels %d",
          period_cnt, period_sz, (flags & PCM_MONO) ? 1 : 2);
 
-    param_init(&params);
-    param_set_mask(&params, SNDRV_PCM_HW_PARAM_ACCESS,
-                   SNDRV_PCM_ACCESS_RW_INTERLEAVED);
-    param_set_mask(&params, SNDRV_PCM_HW_PARAM_FORMAT,
-                   SNDRV_PCM_FORMAT_S16_LE);
-    param_set_mask(&params, SNDRV_PCM_HW_PARAM_SUBFORMAT,
-                   SNDRV_PCM_SUBFORMAT_STD);
-    param_set_min(&params, SNDRV_PCM_HW_PARAM_PERIOD_SIZE, period_sz);
-    param_set_int(&params, SNDRV_PCM_HW_PARAM_SAMPLE_BITS, 16);
-    param_set_int(&params, SNDRV_PCM_HW_PARAM_FRAME_BITS,
-                  (flags & PCM_MONO) ? 16 : 32);
-    param_set_int(&params, SNDRV_PCM_HW_PARAM_CHANNELS,
-                  (flags & PCM_MONO) ? 1 : 2);
-    param_set_int(&params, SNDRV_PCM_HW_PARAM_PERIODS, period_cnt);
-    param_set_int(&params, SNDRV_PCM_HW_PARAM_RATE, 44100);
-
-    if (ioctl(pcm->fd, SNDRV_PCM_IOCTL_HW_PARAMS, &params)) {
-        oops(pcm, errno, "cannot set hw params");
-        goto fail;
+    if (flags & PCM_MMAP) {
+        if (pcm_set_hw_params(pcm, SNDRV_PCM_ACCESS_MMAP_INTERLEAVED,
+                              period_sz, period_cnt) ||
+            pcm_map_buffer(pcm)) {
+            LOGW("pcm_open() no mmap transport (%s), using read/write",
+                 pcm->error);
+            pcm->flags &= ~PCM_MMAP;
+        }
     }
-    param_dump(&params);
+    if (!(pcm->flags & PCM_MMAP) &&
+        pcm_set_hw_params(pcm, SNDRV_PCM_ACCESS_RW_INTERLEAVED,
+                          period_sz, period_cnt))
+        goto fail;
 
     memset(&sparams, 0, sizeof(sparams));
     sparams.tstamp_mode = SNDRV_PCM_TSTAMP_NONE;
     sparams.period_step = 1;
     sparams.avail_min = 1;
-    sparams.start_threshold = period_cnt * period_sz;
-    sparams.stop_threshold = period_cnt * period_sz;
+    sparams.start_threshold = pcm->buffer_size;
+    sparams.stop_threshold = pcm->buffer_size;
     sparams.xfer_align = period_sz / 2; /* needed for old kernels */
     sparams.silence_size = 0;
     sparams.silence_threshold = 0;
 
+    /* pointers wrap at the largest multiple of the buffer that fits, as
+     * the kernel works it out
+     */
+    pcm->boundary = pcm->buffer_size;
+    while (pcm->boundary * 2 <= INT_MAX - pcm->buffer_size)
+        pcm->boundary *= 2;
+    sparams.boundary = pcm->boundary;
+
     if (ioctl(pcm->fd, SNDRV_PCM_IOCTL_SW_PARAMS, &sparams)) {
         oops(pcm, errno, "cannot set sw params");
         goto fail;
     }
+    /* the kernel's word is final */
+    if (sparams.boundary)
+        pcm->boundary = sparams.boundary;
+
+    if ((pcm->flags & PCM_MMAP) && pcm_map_status(pcm)) {
+        LOGW("pcm_open() no mmap transport (%s), using read/write",
+             pcm->error);
+        pcm_unmap(pcm);
+        pcm->flags &= ~PCM_MMAP;
+        if (pcm_set_hw_params(pcm, SNDRV_PCM_ACCESS_RW_INTERLEAVED,
+                              period_sz, period_cnt) ||
+            ioctl(pcm->fd, SNDRV_PCM_IOCTL_SW_PARAMS, &sparams)) {
+            oops(pcm, errno, "cannot set read/write params");
+            goto fail;
+        }
+    }
 
-    pcm->buffer_size = period_cnt * period_sz;
     pcm->underruns = 0;
     return pcm;
 
 fail:
+    pcm_unmap(pcm);
     close(pcm->fd);
     pcm->fd = -1;
     return pcm;
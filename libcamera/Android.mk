@@ -16,6 +16,7 @@ LOCAL_C_INCLUDES += $(LOCAL_PATH)/../libs3cjpeg
 
 
 LOCAL_SRC_FILES:= \
+	CameraTrace.cpp \
 	SecCamera.cpp \
 	SecCameraHWInterface.cpp
 
@@ -0,0 +1,197 @@
+/*
+**
+** Copyright 2010, The Android Open Source Project
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+
+//#define LOG_NDEBUG 0
+#define LOG_TAG "CameraTrace"
+#include <utils/Log.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <cutils/atomic.h>
+
+#include "CameraTrace.h"
+
+namespace android {
+
+static const char *stageNames[CameraTrace::STAGE_MAX] = {
+    "preview interval",
+    "preview hold",
+    "overlay queue",
+    "preview callback",
+    "record dqbuf",
+    "capture stage",
+    "postview stage",
+    "jpeg stage",
+    "shutter to jpeg",
+    "zsl shutter to jpeg",
+    "burst interval",
+};
+
+/* upper bounds of the histogram buckets in us, the last one is open.
+ * 17, 34 and 67ms are one frame at 60, 30 and 15fps.
+ */
+static const uint32_t bucketLimits[] = {
+    1000, 2000, 4000, 8000, 17000, 34000, 67000,
+};
+
+static const char *bucketNames[] = {
+    "<1", "<2", "<4", "<8", "<17", "<34", "<67", ">=67",
+};
+
+CameraTrace::CameraTrace() :
+    mDropped(0),
+    mCallbacksSkipped(0),
+    mLastFrame(0),
+    mFrameInterval(0),
+    mIntervals(0)
+{
+    memset((void *)mCount, 0, sizeof(mCount));
+    memset(mSamples, 0, sizeof(mSamples));
+    memset((void *)mHistogram, 0, sizeof(mHistogram));
+}
+
+void CameraTrace::add(int stage, uint32_t us)
+{
+    int32_t n = android_atomic_inc(&mCount[stage]);
+    mSamples[stage][n & (TRACE_DEPTH - 1)] = us;
+
+    int bucket = 0;
+    while (bucket < HISTOGRAM_BUCKETS - 1 && us >= bucketLimits[bucket])
+        bucket++;
+    android_atomic_inc(&mHistogram[stage][bucket]);
+}
+
+void CameraTrace::record(int stage, nsecs_t start)
+{
+    add(stage, (uint32_t)((now() - start) / 1000));
+}
+
+static int compareSamples(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *)a;
+    uint32_t y = *(const uint32_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+void CameraTrace::previewStarted()
+{
+    mLastFrame = 0;
+    mFrameInterval = 0;
+    mIntervals = 0;
+}
+
+void CameraTrace::previewFrame(nsecs_t time)
+{
+    if (mLastFrame != 0) {
+        nsecs_t interval = time - mLastFrame;
+        add(PREVIEW_INTERVAL, (uint32_t)(interval / 1000));
+
+        /* the previewFrame() calls are the only writers of
+         * PREVIEW_INTERVAL, so every INTERVAL_WINDOW intervals the last
+         * ones are still in the ring.  anything over 1.5 times their
+         * median means frames were lost; a change of the sensor's rate
+         * moves the median along with it.
+         */
+        if (++mIntervals % INTERVAL_WINDOW == 0) {
+            uint32_t samples[INTERVAL_WINDOW];
+            int32_t n = mCount[PREVIEW_INTERVAL];
+            int lost = 0;
+
+            for (int i = 0; i < INTERVAL_WINDOW; i++)
+                samples[i] = mSamples[PREVIEW_INTERVAL][(n - 1 - i) & (TRACE_DEPTH - 1)];
+            qsort(samples, INTERVAL_WINDOW, sizeof(samples[0]), compareSamples);
+            mFrameInterval = microseconds(samples[INTERVAL_WINDOW / 2]);
+
+            for (int i = INTERVAL_WINDOW / 2 + 1;
+                 mFrameInterval > 0 && i < INTERVAL_WINDOW; i++) {
+                nsecs_t gap = microseconds(samples[i]);
+                lost += (gap + mFrameInterval / 2) / mFrameInterval - 1;
+            }
+            if (lost > 0)
+                android_atomic_add(lost, &mDropped);
+        }
+    }
+    mLastFrame = time;
+}
+
+void CameraTrace::frameDropped()
+{
+    android_atomic_inc(&mDropped);
+}
+
+void CameraTrace::callbackSkipped()
+{
+    android_atomic_inc(&mCallbacksSkipped);
+}
+
+void CameraTrace::dump(String8 &result) const
+{
+    const size_t SIZE = 256;
+    char buffer[SIZE];
+    uint32_t samples[TRACE_DEPTH];
+
+    snprintf(buffer, SIZE, " %-23s %8s %7s %7s %7s %7s\n",
+             "latency (us)", "count", "p50", "p95", "p99", "max");
+    result.append(buffer);
+
+    for (int stage = 0; stage < STAGE_MAX; stage++) {
+        int32_t count = mCount[stage];
+        int n = count < TRACE_DEPTH ? count : TRACE_DEPTH;
+
+        if (n == 0) {
+            snprintf(buffer, SIZE, "  %-22s %8d\n", stageNames[stage], 0);
+            result.append(buffer);
+            continue;
+        }
+
+        memcpy(samples, mSamples[stage], n * sizeof(samples[0]));
+        qsort(samples, n, sizeof(samples[0]), compareSamples);
+
+        snprintf(buffer, SIZE, "  %-22s %8d %7u %7u %7u %7u\n",
+                 stageNames[stage], count,
+                 samples[n * 50 / 100], samples[n * 95 / 100], samples[n * 99 / 100],
+                 samples[n - 1]);
+        result.append(buffer);
+    }
+
+    snprintf(buffer, SIZE, " %-23s", "histogram (ms)");
+    result.append(buffer);
+    for (int bucket = 0; bucket < HISTOGRAM_BUCKETS; bucket++) {
+        snprintf(buffer, SIZE, " %7s", bucketNames[bucket]);
+        result.append(buffer);
+    }
+    result.append("\n");
+    for (int stage = 0; stage < STAGE_MAX; stage++) {
+        snprintf(buffer, SIZE, "  %-22s", stageNames[stage]);
+        result.append(buffer);
+        for (int bucket = 0; bucket < HISTOGRAM_BUCKETS; bucket++) {
+            snprintf(buffer, SIZE, " %7d", mHistogram[stage][bucket]);
+            result.append(buffer);
+        }
+        result.append("\n");
+    }
+
+    snprintf(buffer, SIZE, " dropped preview frames (vs. median interval %lld us): %d\n",
+             mFrameInterval / 1000, mDropped);
+    result.append(buffer);
+    snprintf(buffer, SIZE, " skipped preview callbacks: %d\n", mCallbacksSkipped);
+    result.append(buffer);
+}
+
+}; // namespace android
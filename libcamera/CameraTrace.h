@@ -0,0 +1,95 @@
+/*
+**
+** Copyright 2010, The Android Open Source Project
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+
+#ifndef ANDROID_HARDWARE_CAMERA_TRACE_H
+#define ANDROID_HARDWARE_CAMERA_TRACE_H
+
+#include <stdint.h>
+#include <utils/Timers.h>
+#include <utils/String8.h>
+
+namespace android {
+
+/*
+ * Always-on latency trace for the camera HAL.
+ *
+ * Every stage keeps its last TRACE_DEPTH durations in a ring plus an
+ * all-time histogram.  Writers only do an atomic increment and a store,
+ * so recording never blocks the preview or capture threads; dump()
+ * works on a snapshot and may see a sample being overwritten, which
+ * is fine for statistics.
+ */
+class CameraTrace {
+public:
+    enum Stage {
+        PREVIEW_INTERVAL,   /* dequeue to dequeue of preview frames */
+        PREVIEW_HOLD,       /* dequeue to requeue of a preview frame */
+        OVERLAY_QUEUE,      /* overlay queueBuffer/dequeueBuffer */
+        PREVIEW_CALLBACK,   /* CAMERA_MSG_PREVIEW_FRAME data callback */
+        RECORD_DQBUF,       /* record thread waiting for a frame */
+        CAPTURE_STAGE,      /* sensor capture and demux of one shot */
+        POSTVIEW_STAGE,     /* thumbnail, raw callback and overlay */
+        JPEG_STAGE,         /* EXIF and compressed callback */
+        SHUTTER_TO_JPEG,    /* takePicture() to the compressed callback */
+        ZSL_SHUTTER_TO_JPEG, /* the same for shots from the zsl ring */
+        BURST_INTERVAL,     /* shutter to shutter within a burst */
+        STAGE_MAX,
+    };
+
+    CameraTrace();
+
+    static nsecs_t  now() { return systemTime(SYSTEM_TIME_MONOTONIC); }
+
+    /* adds now() - start to stage */
+    void            record(int stage, nsecs_t start);
+
+    /* preview frame dequeued at time; counts the frames the sensor
+     * delivered in between that never reached us.  the sensor slows
+     * down in low light, so gaps are measured against the median of
+     * the surrounding intervals rather than the configured frame rate,
+     * and counted once per INTERVAL_WINDOW frames.
+     */
+    void            previewFrame(nsecs_t time);
+    void            previewStarted();
+    void            frameDropped();
+    void            callbackSkipped();
+
+    void            dump(String8 &result) const;
+
+private:
+    enum {
+        TRACE_DEPTH = 256,      /* must be a power of two */
+        HISTOGRAM_BUCKETS = 8,
+        INTERVAL_WINDOW = 32,   /* intervals per median update */
+    };
+
+    void            add(int stage, uint32_t us);
+
+    volatile int32_t mCount[STAGE_MAX];
+    uint32_t        mSamples[STAGE_MAX][TRACE_DEPTH];   /* us */
+    volatile int32_t mHistogram[STAGE_MAX][HISTOGRAM_BUCKETS];
+
+    volatile int32_t mDropped;
+    volatile int32_t mCallbacksSkipped;
+    nsecs_t         mLastFrame;
+    nsecs_t         mFrameInterval;     /* last median, 0 until measured */
+    int             mIntervals;         /* since previewStarted() */
+};
+
+}; // namespace android
+
+#endif // ANDROID_HARDWARE_CAMERA_TRACE_H
@@ -30,6 +30,7 @@
 
 #include <string.h>
 #include <stdlib.h>
+#include <errno.h>
 #include <sys/poll.h>
 #include "SecCamera.h"
 #include "cutils/properties.h"
@@ -190,7 +191,11 @@ int SecCamera::previewPoll(bool preview)
     }
 
     if (ret == 0) {
-        LOGE("ERR(%s):No data in 1 secs.. Camera Device Reset \n", __func__);
+        /* the record node goes quiet while recording is paused */
+        if (preview)
+            LOGE("ERR(%s):No data in 1 secs.. Camera Device Reset \n", __func__);
+        else
+            LOGV("%s : no record frame in 1 sec", __func__);
         return ret;
     }
 
@@ -433,11 +438,12 @@ static int fimc_v4l2_qbuf(int fp, int index)
     return 0;
 }
 
-static int fimc_v4l2_dqbuf(int fp)
+static int fimc_v4l2_dqbuf(int fp, struct timeval *timestamp = NULL)
 {
     struct v4l2_buffer v4l2_buf;
     int ret;
 
+    memset(&v4l2_buf, 0, sizeof(v4l2_buf));
     v4l2_buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
     v4l2_buf.memory = V4L2_MEMORY_MMAP;
 
@@ -447,6 +453,9 @@ static int fimc_v4l2_dqbuf(int fp)
         return ret;
     }
 
+    if (timestamp != NULL)
+        *timestamp = v4l2_buf.timestamp;
+
     return v4l2_buf.index;
 }
 
@@ -582,7 +591,8 @@ SecCamera::SecCamera() :
             m_flag_camera_start(0),
             m_jpeg_thumbnail_width (0),
             m_jpeg_thumbnail_height(0),
-            m_jpeg_quality(100)
+            m_jpeg_quality(100),
+            m_jpeg_target_size(0)
 #ifdef ENABLE_ESD_PREVIEW_CHECK
             ,
             m_esd_check_count(0)
@@ -605,6 +615,7 @@ SecCamera::SecCamera() :
     m_params->white_balance = -1;
 
     memset(&m_capture_buf, 0, sizeof(m_capture_buf));
+    memset(m_preview_buf_held, 0, sizeof(m_preview_buf_held));
 
     LOGV("%s :", __func__);
 }
@@ -860,6 +871,7 @@ int SecCamera::startPreview(void)
     for (int i = 0; i < MAX_BUFFERS; i++) {
         ret = fimc_v4l2_qbuf(m_cam_fd, i);
         CHECK(ret);
+        m_preview_buf_held[i] = false;
     }
 
     ret = fimc_v4l2_streamon(m_cam_fd);
@@ -911,6 +923,8 @@ int SecCamera::stopPreview(void)
     ret = fimc_v4l2_streamoff(m_cam_fd);
     CHECK(ret);
 
+    /* streamoff hands every buffer back to the driver */
+    memset(m_preview_buf_held, 0, sizeof(m_preview_buf_held));
     m_flag_camera_start = 0;
 
     return ret;
@@ -1077,21 +1091,78 @@ int SecCamera::getPreview()
         return -1;
     }
 
-    ret = fimc_v4l2_qbuf(m_cam_fd, index);
-    CHECK(ret);
+    /* the buffer now belongs to the caller until releasePreviewFrame() */
+    m_preview_buf_held[index] = true;
 
     return index;
 }
 
-int SecCamera::getRecordFrame()
+int SecCamera::releasePreviewFrame(int index)
 {
+    if (!(0 <= index && index < MAX_BUFFERS)) {
+        LOGE("ERR(%s):wrong index = %d\n", __func__, index);
+        return -1;
+    }
+
+    if (!m_flag_camera_start || !m_preview_buf_held[index]) {
+        /* the preview was stopped or restarted while the frame was
+         * out, so the driver already owns this buffer again.
+         */
+        LOGV("%s: buffer %d not held, ignoring", __func__, index);
+        return 0;
+    }
+
+    m_preview_buf_held[index] = false;
+    return fimc_v4l2_qbuf(m_cam_fd, index);
+}
+
+/* dequeues a record frame and returns in *timestamp when it was
+ * captured, on the monotonic clock the recorder uses.
+ */
+int SecCamera::getRecordFrame(nsecs_t *timestamp)
+{
+    struct timeval tv;
+    int index;
+    int ret;
+
     if (m_flag_record_start == 0) {
         LOGE("%s: m_flag_record_start is 0", __func__);
         return -1;
     }
 
-    previewPoll(false);
-    return fimc_v4l2_dqbuf(m_cam_fd2);
+    /* don't block in DQBUF when no frame came, so the caller can see
+     * the recording being stopped
+     */
+    ret = previewPoll(false);
+    if (ret == 0)
+        return -EAGAIN;
+    if (ret < 0)
+        return -1;
+    index = fimc_v4l2_dqbuf(m_cam_fd2, &tv);
+    if (index < 0)
+        return index;
+
+    /* depending on the kernel the buffer is stamped with the monotonic
+     * clock, the wall clock or not at all.  anything more than a second
+     * away from both clocks is treated as unstamped.
+     */
+    nsecs_t now = systemTime(SYSTEM_TIME_MONOTONIC);
+    nsecs_t stamp = seconds(tv.tv_sec) + microseconds(tv.tv_usec);
+    nsecs_t age;
+
+    *timestamp = now;
+    if (stamp != 0) {
+        age = now - stamp;
+        if (0 <= age && age < seconds(1)) {
+            *timestamp = stamp;
+        } else {
+            age = systemTime(SYSTEM_TIME_REALTIME) - stamp;
+            if (0 <= age && age < seconds(1))
+                *timestamp = now - age;
+        }
+    }
+
+    return index;
 }
 
 int SecCamera::releaseRecordFrame(int index)
@@ -1277,16 +1348,25 @@ unsigned char* SecCamera::getJpeg(int *jpeg_size, unsigned int *phyaddr)
     return addr;
 }
 
-int SecCamera::getExif(unsigned char *pExifDst, unsigned char *pThumbSrc)
-{
-    JpegEncoder jpgEnc;
+/* encodes the thumbnail and builds the EXIF segment around it.  both use
+ * the encoder's stream buffer, so they run as one job.
+ */
+struct SecCamera::ExifJob : public JpegJob {
+    SecCamera       *camera;
+    exif_attribute_t *exif;
+    unsigned char   *exifDst;
+    unsigned char   *thumbSrc;
+    unsigned int    exifSize;
 
-    LOGV("%s : m_jpeg_thumbnail_width = %d, height = %d",
-         __func__, m_jpeg_thumbnail_width, m_jpeg_thumbnail_height);
-    if ((m_jpeg_thumbnail_width > 0) && (m_jpeg_thumbnail_height > 0)) {
+    virtual jpg_return_status run(JpegEncoder *jpgEnc);
+};
+
+jpg_return_status SecCamera::ExifJob::run(JpegEncoder *jpgEnc)
+{
+    if (exif->enableThumb) {
         int inFormat = JPG_MODESEL_YCBCR;
         int outFormat = JPG_422;
-        switch (m_snapshot_v4lformat) {
+        switch (camera->m_snapshot_v4lformat) {
         case V4L2_PIX_FMT_NV12:
         case V4L2_PIX_FMT_NV21:
         case V4L2_PIX_FMT_NV12T:
@@ -1300,49 +1380,83 @@ int SecCamera::getExif(unsigned char *pExifDst, unsigned char *pThumbSrc)
             break;
         }
 
-        if (jpgEnc.setConfig(JPEG_SET_ENCODE_IN_FORMAT, inFormat) != JPG_SUCCESS)
-            return -1;
+        if (jpgEnc->setConfig(JPEG_SET_ENCODE_IN_FORMAT, inFormat) != JPG_SUCCESS)
+            return JPG_FAIL;
 
-        if (jpgEnc.setConfig(JPEG_SET_SAMPING_MODE, outFormat) != JPG_SUCCESS)
-            return -1;
+        if (jpgEnc->setConfig(JPEG_SET_SAMPING_MODE, outFormat) != JPG_SUCCESS)
+            return JPG_FAIL;
 
-        if (jpgEnc.setConfig(JPEG_SET_ENCODE_QUALITY, JPG_QUALITY_LEVEL_2) != JPG_SUCCESS)
-            return -1;
+        if (jpgEnc->setConfig(JPEG_SET_ENCODE_QUALITY, JPG_QUALITY_LEVEL_2) != JPG_SUCCESS)
+            return JPG_FAIL;
 
         int thumbWidth, thumbHeight, thumbSrcSize;
-        getThumbnailConfig(&thumbWidth, &thumbHeight, &thumbSrcSize);
-        if (jpgEnc.setConfig(JPEG_SET_ENCODE_WIDTH, thumbWidth) != JPG_SUCCESS)
-            return -1;
+        camera->getThumbnailConfig(&thumbWidth, &thumbHeight, &thumbSrcSize);
+        if (jpgEnc->setConfig(JPEG_SET_ENCODE_WIDTH, thumbWidth) != JPG_SUCCESS)
+            return JPG_FAIL;
 
-        if (jpgEnc.setConfig(JPEG_SET_ENCODE_HEIGHT, thumbHeight) != JPG_SUCCESS)
-            return -1;
+        if (jpgEnc->setConfig(JPEG_SET_ENCODE_HEIGHT, thumbHeight) != JPG_SUCCESS)
+            return JPG_FAIL;
 
-        char *pInBuf = (char *)jpgEnc.getInBuf(thumbSrcSize);
+        char *pInBuf = (char *)jpgEnc->getInBuf(thumbSrcSize);
         if (pInBuf == NULL)
-            return -1;
-        memcpy(pInBuf, pThumbSrc, thumbSrcSize);
+            return JPG_FAIL;
+        memcpy(pInBuf, thumbSrc, thumbSrcSize);
 
         unsigned int thumbSize;
 
-        jpgEnc.encode(&thumbSize, NULL);
+        jpgEnc->encode(&thumbSize, NULL);
+    }
+
+    LOGV("%s: calling jpgEnc.makeExif, width set to %d, height to %d\n",
+         __func__, exif->width, exif->height);
+
+    LOG_TIME_DEFINE(0)
+    LOG_TIME_START(0)
+    jpg_return_status ret = jpgEnc->makeExif(exifDst, exif, &exifSize, true,
+                                             &camera->mExifTemplate);
+    LOG_TIME_END(0)
+    LOG_CAMERA("makeExif interval: %lu us", LOG_TIME(0));
+
+    return ret;
+}
+
+/* the attributes that change from shot to shot, read from the driver and
+ * the current settings.  called when the shot is taken, so settings made
+ * while its JPEG is still being put together don't end up in it.
+ */
+void SecCamera::getExifAttributes(exif_attribute_t *exif)
+{
+    *exif = mExifInfo;
 
+    LOGV("%s : m_jpeg_thumbnail_width = %d, height = %d",
+         __func__, m_jpeg_thumbnail_width, m_jpeg_thumbnail_height);
+    if ((m_jpeg_thumbnail_width > 0) && (m_jpeg_thumbnail_height > 0)) {
         LOGV("%s : enableThumb set to true", __func__);
-        mExifInfo.enableThumb = true;
+        exif->enableThumb = true;
     } else {
         LOGV("%s : enableThumb set to false", __func__);
-        mExifInfo.enableThumb = false;
+        exif->enableThumb = false;
     }
 
-    unsigned int exifSize;
-
-    setExifChangedAttribute();
+    setExifChangedAttribute(exif);
+}
 
-    LOGV("%s: calling jpgEnc.makeExif, mExifInfo.width set to %d, height to %d\n",
-         __func__, mExifInfo.width, mExifInfo.height);
+int SecCamera::getExif(unsigned char *pExifDst, unsigned char *pThumbSrc,
+                       exif_attribute_t *exif)
+{
+    ExifJob job;
 
-    jpgEnc.makeExif(pExifDst, &mExifInfo, &exifSize, true);
+    job.camera = this;
+    job.exif = exif;
+    job.exifDst = pExifDst;
+    job.thumbSrc = pThumbSrc;
+    job.exifSize = 0;
+    if (JpegService::getInstance()->run(&job) != JPG_SUCCESS) {
+        LOGE("ERR(%s):Fail on the exif job", __func__);
+        return -1;
+    }
 
-    return exifSize;
+    return job.exifSize;
 }
 
 void SecCamera::getPostViewConfig(int *width, int *height, int *size)
@@ -1380,6 +1494,128 @@ int SecCamera::getPostViewOffset(void)
     return m_postview_offset;
 }
 
+/* the capture buffer is read once: each chunk goes to the postview and
+ * then, while it is still in the cache, to the encoder's frame buffer.
+ */
+#define SNAPSHOT_COPY_CHUNK     (16 * 1024)
+
+static void copySnapshot(unsigned char *enc_buf, unsigned char *yuv_buf,
+                         const unsigned char *src, unsigned int size)
+{
+    if (yuv_buf == NULL) {
+        memcpy(enc_buf, src, size);
+        return;
+    }
+
+    for (unsigned int offset = 0; offset < size; offset += SNAPSHOT_COPY_CHUNK) {
+        unsigned int len = size - offset;
+        if (len > SNAPSHOT_COPY_CHUNK)
+            len = SNAPSHOT_COPY_CHUNK;
+
+        memcpy(yuv_buf + offset, src + offset, len);
+        memcpy(enc_buf + offset, yuv_buf + offset, len);
+    }
+}
+
+/* encodes a snapshot sized frame.  with capture set the frame is copied
+ * out of the capture buffer into the encoder and yuvBuf, otherwise it is
+ * read from yuvBuf.  EXIF is added when exif is set.
+ */
+struct SecCamera::SnapshotJob : public JpegJob {
+    SecCamera       *camera;
+    unsigned char   *capture;
+    unsigned char   *yuvBuf;
+    unsigned char   *jpegBuf;
+    unsigned int    *outputSize;
+    exif_attribute_t *exif;
+    unsigned int    targetSize;     /* bytes for the image, 0 for off */
+
+    virtual jpg_return_status run(JpegEncoder *jpgEnc);
+};
+
+jpg_return_status SecCamera::SnapshotJob::run(JpegEncoder *jpgEnc)
+{
+    camera->setJpegEncoderConfig(jpgEnc);
+
+    unsigned int snapshot_size = camera->m_snapshot_width * camera->m_snapshot_height * 2;
+    unsigned char *pInBuf = (unsigned char *)jpgEnc->getInBuf(snapshot_size);
+
+    if (pInBuf == NULL) {
+        LOGE("JPEG input buffer is NULL!!\n");
+        return JPG_FAIL;
+    }
+
+    if (capture != NULL)
+        copySnapshot(pInBuf, yuvBuf, capture, snapshot_size);
+    else
+        memcpy(pInBuf, yuvBuf, snapshot_size);
+
+    if (jpgEnc->setConfig(JPEG_SET_ENCODE_TARGET_SIZE, targetSize) != JPG_SUCCESS)
+        LOGE("[JPEG_SET_ENCODE_TARGET_SIZE] Error\n");
+
+    jpg_return_status ret;
+    if (exif != NULL)
+        ret = jpgEnc->encode(outputSize, exif, &camera->mExifTemplate);
+    else
+        ret = jpgEnc->encode(outputSize, NULL);
+    if (ret != JPG_SUCCESS) {
+        LOGE("ERR(%s):Fail on jpgEnc.encode()", __func__);
+        return ret;
+    }
+
+    ret = jpgEnc->copyOutBuf(jpegBuf, outputSize);
+    if (ret != JPG_SUCCESS)
+        LOGE("JPEG output buffer is NULL!!\n");
+
+    return ret;
+}
+
+/* sets the encoder up for a snapshot sized frame in m_snapshot_v4lformat */
+void SecCamera::setJpegEncoderConfig(JpegEncoder *jpgEnc)
+{
+    int inFormat = JPG_MODESEL_YCBCR;
+    int outFormat = JPG_422;
+
+    switch (m_snapshot_v4lformat) {
+    case V4L2_PIX_FMT_NV12:
+    case V4L2_PIX_FMT_NV21:
+    case V4L2_PIX_FMT_NV12T:
+    case V4L2_PIX_FMT_YUV420:
+        outFormat = JPG_420;
+        break;
+    case V4L2_PIX_FMT_YUYV:
+    case V4L2_PIX_FMT_UYVY:
+    case V4L2_PIX_FMT_YUV422P:
+    default:
+        outFormat = JPG_422;
+        break;
+    }
+
+    if (jpgEnc->setConfig(JPEG_SET_ENCODE_IN_FORMAT, inFormat) != JPG_SUCCESS)
+        LOGE("[JPEG_SET_ENCODE_IN_FORMAT] Error\n");
+
+    if (jpgEnc->setConfig(JPEG_SET_SAMPING_MODE, outFormat) != JPG_SUCCESS)
+        LOGE("[JPEG_SET_SAMPING_MODE] Error\n");
+
+    image_quality_type_t jpegQuality;
+    if (m_jpeg_quality >= 90)
+        jpegQuality = JPG_QUALITY_LEVEL_1;
+    else if (m_jpeg_quality >= 80)
+        jpegQuality = JPG_QUALITY_LEVEL_2;
+    else if (m_jpeg_quality >= 70)
+        jpegQuality = JPG_QUALITY_LEVEL_3;
+    else
+        jpegQuality = JPG_QUALITY_LEVEL_4;
+
+    if (jpgEnc->setConfig(JPEG_SET_ENCODE_QUALITY, jpegQuality) != JPG_SUCCESS)
+        LOGE("[JPEG_SET_ENCODE_QUALITY] Error\n");
+    if (jpgEnc->setConfig(JPEG_SET_ENCODE_WIDTH, m_snapshot_width) != JPG_SUCCESS)
+        LOGE("[JPEG_SET_ENCODE_WIDTH] Error\n");
+
+    if (jpgEnc->setConfig(JPEG_SET_ENCODE_HEIGHT, m_snapshot_height) != JPG_SUCCESS)
+        LOGE("[JPEG_SET_ENCODE_HEIGHT] Error\n");
+}
+
 int SecCamera::getSnapshotAndJpeg(unsigned char *yuv_buf, unsigned char *jpeg_buf,
                                             unsigned int *output_size)
 {
@@ -1436,6 +1672,9 @@ int SecCamera::getSnapshotAndJpeg(unsigned char *yuv_buf, unsigned char *jpeg_bu
         LOGV("SnapshotFormat:UnknownFormat");
 #endif
 
+    SnapshotJob job;
+    exif_attribute_t exif;
+
     LOG_TIME_START(1) // prepare
     int nframe = 1;
 
@@ -1464,85 +1703,74 @@ int SecCamera::getSnapshotAndJpeg(unsigned char *yuv_buf, unsigned char *jpeg_bu
 
     LOG_TIME_END(2)
 
-    LOGI("%s : calling memcpy from m_capture_buf", __func__);
-    memcpy(yuv_buf, (unsigned char*)m_capture_buf.start, m_snapshot_width * m_snapshot_height * 2);
+    /* the copy into the encoder and the encode run on the JPEG service
+     * while the stream is taken down here.  the sensor is paused and the
+     * capture buffer stays mapped, so its contents can't change under it.
+     */
+    LOG_TIME_START(3) // submit
+    getExifAttributes(&exif);
+    job.camera = this;
+    job.capture = (unsigned char *)m_capture_buf.start;
+    job.yuvBuf = yuv_buf;
+    job.jpegBuf = jpeg_buf;
+    job.outputSize = output_size;
+    job.exif = &exif;
+    job.targetSize = m_jpeg_target_size;
+    ret = JpegService::getInstance()->submit(&job);
+    LOG_TIME_END(3)
+
     LOG_TIME_START(5) // post
     fimc_v4l2_streamoff(m_cam_fd);
     LOG_TIME_END(5)
 
-    LOG_CAMERA("getSnapshotAndJpeg intervals : stopPreview(%lu), prepare(%lu),"
-                " capture(%lu), memcpy(%lu), yuv2Jpeg(%lu), post(%lu)  us",
-                    LOG_TIME(0), LOG_TIME(1), LOG_TIME(2), LOG_TIME(3), LOG_TIME(4), LOG_TIME(5));
-    /* JPEG encoding */
-    JpegEncoder jpgEnc;
-    int inFormat = JPG_MODESEL_YCBCR;
-    int outFormat = JPG_422;
-
-    switch (m_snapshot_v4lformat) {
-    case V4L2_PIX_FMT_NV12:
-    case V4L2_PIX_FMT_NV21:
-    case V4L2_PIX_FMT_NV12T:
-    case V4L2_PIX_FMT_YUV420:
-        outFormat = JPG_420;
-        break;
-    case V4L2_PIX_FMT_YUYV:
-    case V4L2_PIX_FMT_UYVY:
-    case V4L2_PIX_FMT_YUV422P:
-    default:
-        outFormat = JPG_422;
-        break;
+    if (ret != JPG_SUCCESS) {
+        LOGE("ERR(%s):Fail on submitting the jpeg job", __func__);
+        return -1;
     }
 
-    if (jpgEnc.setConfig(JPEG_SET_ENCODE_IN_FORMAT, inFormat) != JPG_SUCCESS)
-        LOGE("[JPEG_SET_ENCODE_IN_FORMAT] Error\n");
-
-    if (jpgEnc.setConfig(JPEG_SET_SAMPING_MODE, outFormat) != JPG_SUCCESS)
-        LOGE("[JPEG_SET_SAMPING_MODE] Error\n");
-
-    image_quality_type_t jpegQuality;
-    if (m_jpeg_quality >= 90)
-        jpegQuality = JPG_QUALITY_LEVEL_1;
-    else if (m_jpeg_quality >= 80)
-        jpegQuality = JPG_QUALITY_LEVEL_2;
-    else if (m_jpeg_quality >= 70)
-        jpegQuality = JPG_QUALITY_LEVEL_3;
-    else
-        jpegQuality = JPG_QUALITY_LEVEL_4;
-
-    if (jpgEnc.setConfig(JPEG_SET_ENCODE_QUALITY, jpegQuality) != JPG_SUCCESS)
-        LOGE("[JPEG_SET_ENCODE_QUALITY] Error\n");
-    if (jpgEnc.setConfig(JPEG_SET_ENCODE_WIDTH, m_snapshot_width) != JPG_SUCCESS)
-        LOGE("[JPEG_SET_ENCODE_WIDTH] Error\n");
-
-    if (jpgEnc.setConfig(JPEG_SET_ENCODE_HEIGHT, m_snapshot_height) != JPG_SUCCESS)
-        LOGE("[JPEG_SET_ENCODE_HEIGHT] Error\n");
+    LOG_TIME_START(4) // memcpy and yuv2Jpeg
+    ret = JpegService::getInstance()->wait(&job);
+    LOG_TIME_END(4)
+    if (ret != JPG_SUCCESS)
+        return -1;
 
-    unsigned int snapshot_size = m_snapshot_width * m_snapshot_height * 2;
-    unsigned char *pInBuf = (unsigned char *)jpgEnc.getInBuf(snapshot_size);
+    LOG_CAMERA("getSnapshotAndJpeg intervals : stopPreview(%lu), prepare(%lu),"
+                " capture(%lu), submit(%lu), memcpy and yuv2Jpeg(%lu), post(%lu)  us",
+                    LOG_TIME(0), LOG_TIME(1), LOG_TIME(2), LOG_TIME(3), LOG_TIME(4), LOG_TIME(5));
 
-    if (pInBuf == NULL) {
-        LOGE("JPEG input buffer is NULL!!\n");
-        return -1;
-    }
-    memcpy(pInBuf, yuv_buf, snapshot_size);
+    return 0;
+}
 
-    setExifChangedAttribute();
-    jpgEnc.encode(output_size, &mExifInfo);
 
-    uint64_t outbuf_size;
-    unsigned char *pOutBuf = (unsigned char *)jpgEnc.getOutBuf(&outbuf_size);
+/* encodes a snapshot sized frame that is already in memory, without
+ * touching the sensor.  no EXIF is added, the caller does that.
+ */
+int SecCamera::encodeSnapshot(unsigned char *yuv_buf, unsigned char *jpeg_buf,
+                              unsigned int *output_size)
+{
+    LOGV("%s :", __func__);
 
-    if (pOutBuf == NULL) {
-        LOGE("JPEG output buffer is NULL!!\n");
+    LOG_TIME_DEFINE(0)
+    LOG_TIME_START(0)
+
+    SnapshotJob job;
+
+    job.camera = this;
+    job.capture = NULL;
+    job.yuvBuf = yuv_buf;
+    job.jpegBuf = jpeg_buf;
+    job.outputSize = output_size;
+    job.exif = NULL;
+    job.targetSize = m_jpeg_target_size;
+    if (JpegService::getInstance()->run(&job) != JPG_SUCCESS)
         return -1;
-    }
 
-    memcpy(jpeg_buf, pOutBuf, outbuf_size);
+    LOG_TIME_END(0)
+    LOG_CAMERA("encodeSnapshot interval: %lu us", LOG_TIME(0));
 
     return 0;
 }
 
-
 int SecCamera::setSnapshotSize(int width, int height)
 {
     LOGV("%s(width(%d), height(%d))", __func__, width, height);
@@ -2208,6 +2436,29 @@ int SecCamera::getJpegQuality(void)
     return m_jpeg_quality;
 }
 
+/* byte budget for the images encoded here, 0 to use the jpeg quality.
+ * the sensor makes the back camera's JPEG, so that one isn't affected
+ * unless it comes from the zsl ring.
+ */
+int SecCamera::setJpegTargetSize(int target_size)
+{
+    LOGV("%s(target_size (%d))", __func__, target_size);
+
+    if (target_size < 0) {
+        LOGE("ERR(%s):Invalid target_size (%d)", __func__, target_size);
+        return -1;
+    }
+
+    m_jpeg_target_size = target_size;
+
+    return 0;
+}
+
+int SecCamera::getJpegTargetSize(void)
+{
+    return m_jpeg_target_size;
+}
+
 //======================================================================
 
 int SecCamera::setZoom(int zoom_level)
@@ -2877,31 +3128,33 @@ void SecCamera::setExifFixedAttribute()
     mExifInfo.y_resolution.num = EXIF_DEF_RESOLUTION_NUM;
     mExifInfo.y_resolution.den = EXIF_DEF_RESOLUTION_DEN;
     mExifInfo.resolution_unit = EXIF_DEF_RESOLUTION_UNIT;
+
+    mExifTemplate.invalidate();
 }
 
-void SecCamera::setExifChangedAttribute()
+void SecCamera::setExifChangedAttribute(exif_attribute_t *exif)
 {
     //2 0th IFD TIFF Tags
     //3 Width
-    mExifInfo.width = m_snapshot_width;
+    exif->width = m_snapshot_width;
     //3 Height
-    mExifInfo.height = m_snapshot_height;
+    exif->height = m_snapshot_height;
     //3 Orientation
     switch (m_exif_orientation) {
     case 0:
-        mExifInfo.orientation = EXIF_ORIENTATION_UP;
+        exif->orientation = EXIF_ORIENTATION_UP;
         break;
     case 90:
-        mExifInfo.orientation = EXIF_ORIENTATION_90;
+        exif->orientation = EXIF_ORIENTATION_90;
         break;
     case 180:
-        mExifInfo.orientation = EXIF_ORIENTATION_180;
+        exif->orientation = EXIF_ORIENTATION_180;
         break;
     case 270:
-        mExifInfo.orientation = EXIF_ORIENTATION_270;
+        exif->orientation = EXIF_ORIENTATION_270;
         break;
     default:
-        mExifInfo.orientation = EXIF_ORIENTATION_UP;
+        exif->orientation = EXIF_ORIENTATION_UP;
         break;
     }
     //3 Date time
@@ -2909,7 +3162,7 @@ void SecCamera::setExifChangedAttribute()
     struct tm *timeinfo;
     time(&rawtime);
     timeinfo = localtime(&rawtime);
-    strftime((char *)mExifInfo.date_time, 20, "%Y:%m:%d %H:%M:%S", timeinfo);
+    strftime((char *)exif->date_time, 20, "%Y:%m:%d %H:%M:%S", timeinfo);
 
     //2 0th IFD Exif Private Tags
     //3 Exposure Time
@@ -2923,9 +3176,9 @@ void SecCamera::setExifChangedAttribute()
              __func__, shutterSpeed, m_camera_id);
         shutterSpeed = 100;
     }
-    mExifInfo.exposure_time.num = 1;
+    exif->exposure_time.num = 1;
     // x us -> 1/x s */
-    mExifInfo.exposure_time.den = (uint32_t)(1000000 / shutterSpeed);
+    exif->exposure_time.den = (uint32_t)(1000000 / shutterSpeed);
 
     //3 ISO Speed Rating
     int iso = fimc_v4l2_g_ctrl(m_cam_fd, V4L2_CID_CAMERA_GET_ISO);
@@ -2939,154 +3192,154 @@ void SecCamera::setExifChangedAttribute()
     }
     switch(iso) {
         case ISO_50:
-            mExifInfo.iso_speed_rating = 50;
+            exif->iso_speed_rating = 50;
             break;
         case ISO_100:
-            mExifInfo.iso_speed_rating = 100;
+            exif->iso_speed_rating = 100;
             break;
         case ISO_200:
-            mExifInfo.iso_speed_rating = 200;
+            exif->iso_speed_rating = 200;
             break;
         case ISO_400:
-            mExifInfo.iso_speed_rating = 400;
+            exif->iso_speed_rating = 400;
             break;
         case ISO_800:
-            mExifInfo.iso_speed_rating = 800;
+            exif->iso_speed_rating = 800;
             break;
         case ISO_1600:
-            mExifInfo.iso_speed_rating = 1600;
+            exif->iso_speed_rating = 1600;
             break;
         default:
-            mExifInfo.iso_speed_rating = 100;
+            exif->iso_speed_rating = 100;
             break;
     }
 
     uint32_t av, tv, bv, sv, ev;
-    av = APEX_FNUM_TO_APERTURE((double)mExifInfo.fnumber.num / mExifInfo.fnumber.den);
-    tv = APEX_EXPOSURE_TO_SHUTTER((double)mExifInfo.exposure_time.num / mExifInfo.exposure_time.den);
-    sv = APEX_ISO_TO_FILMSENSITIVITY(mExifInfo.iso_speed_rating);
+    av = APEX_FNUM_TO_APERTURE((double)exif->fnumber.num / exif->fnumber.den);
+    tv = APEX_EXPOSURE_TO_SHUTTER((double)exif->exposure_time.num / exif->exposure_time.den);
+    sv = APEX_ISO_TO_FILMSENSITIVITY(exif->iso_speed_rating);
     bv = av + tv - sv;
     ev = av + tv;
-    LOGD("Shutter speed=%d us, iso=%d\n", shutterSpeed, mExifInfo.iso_speed_rating);
+    LOGD("Shutter speed=%d us, iso=%d\n", shutterSpeed, exif->iso_speed_rating);
     LOGD("AV=%d, TV=%d, SV=%d\n", av, tv, sv);
 
     //3 Shutter Speed
-    mExifInfo.shutter_speed.num = tv*EXIF_DEF_APEX_DEN;
-    mExifInfo.shutter_speed.den = EXIF_DEF_APEX_DEN;
+    exif->shutter_speed.num = tv*EXIF_DEF_APEX_DEN;
+    exif->shutter_speed.den = EXIF_DEF_APEX_DEN;
     //3 Brightness
-    mExifInfo.brightness.num = bv*EXIF_DEF_APEX_DEN;
-    mExifInfo.brightness.den = EXIF_DEF_APEX_DEN;
+    exif->brightness.num = bv*EXIF_DEF_APEX_DEN;
+    exif->brightness.den = EXIF_DEF_APEX_DEN;
     //3 Exposure Bias
     if (m_params->scene_mode == SCENE_MODE_BEACH_SNOW) {
-        mExifInfo.exposure_bias.num = EXIF_DEF_APEX_DEN;
-        mExifInfo.exposure_bias.den = EXIF_DEF_APEX_DEN;
+        exif->exposure_bias.num = EXIF_DEF_APEX_DEN;
+        exif->exposure_bias.den = EXIF_DEF_APEX_DEN;
     } else {
-        mExifInfo.exposure_bias.num = 0;
-        mExifInfo.exposure_bias.den = 0;
+        exif->exposure_bias.num = 0;
+        exif->exposure_bias.den = 0;
     }
     //3 Metering Mode
     switch (m_params->metering) {
     case METERING_SPOT:
-        mExifInfo.metering_mode = EXIF_METERING_SPOT;
+        exif->metering_mode = EXIF_METERING_SPOT;
         break;
     case METERING_MATRIX:
-        mExifInfo.metering_mode = EXIF_METERING_AVERAGE;
+        exif->metering_mode = EXIF_METERING_AVERAGE;
         break;
     case METERING_CENTER:
-        mExifInfo.metering_mode = EXIF_METERING_CENTER;
+        exif->metering_mode = EXIF_METERING_CENTER;
         break;
     default :
-        mExifInfo.metering_mode = EXIF_METERING_AVERAGE;
+        exif->metering_mode = EXIF_METERING_AVERAGE;
         break;
     }
 
     //3 Flash
     int flash = fimc_v4l2_g_ctrl(m_cam_fd, V4L2_CID_CAMERA_GET_FLASH_ONOFF);
     if (flash < 0)
-        mExifInfo.flash = EXIF_DEF_FLASH;
+        exif->flash = EXIF_DEF_FLASH;
     else
-        mExifInfo.flash = flash;
+        exif->flash = flash;
 
     //3 White Balance
     if (m_params->white_balance == WHITE_BALANCE_AUTO)
-        mExifInfo.white_balance = EXIF_WB_AUTO;
+        exif->white_balance = EXIF_WB_AUTO;
     else
-        mExifInfo.white_balance = EXIF_WB_MANUAL;
+        exif->white_balance = EXIF_WB_MANUAL;
     //3 Scene Capture Type
     switch (m_params->scene_mode) {
     case SCENE_MODE_PORTRAIT:
-        mExifInfo.scene_capture_type = EXIF_SCENE_PORTRAIT;
+        exif->scene_capture_type = EXIF_SCENE_PORTRAIT;
         break;
     case SCENE_MODE_LANDSCAPE:
-        mExifInfo.scene_capture_type = EXIF_SCENE_LANDSCAPE;
+        exif->scene_capture_type = EXIF_SCENE_LANDSCAPE;
         break;
     case SCENE_MODE_NIGHTSHOT:
-        mExifInfo.scene_capture_type = EXIF_SCENE_NIGHT;
+        exif->scene_capture_type = EXIF_SCENE_NIGHT;
         break;
     default:
-        mExifInfo.scene_capture_type = EXIF_SCENE_STANDARD;
+        exif->scene_capture_type = EXIF_SCENE_STANDARD;
         break;
     }
 
     //2 0th IFD GPS Info Tags
     if (m_gps_latitude != 0 && m_gps_longitude != 0) {
         if (m_gps_latitude > 0)
-            strcpy((char *)mExifInfo.gps_latitude_ref, "N");
+            strcpy((char *)exif->gps_latitude_ref, "N");
         else
-            strcpy((char *)mExifInfo.gps_latitude_ref, "S");
+            strcpy((char *)exif->gps_latitude_ref, "S");
 
         if (m_gps_longitude > 0)
-            strcpy((char *)mExifInfo.gps_longitude_ref, "E");
+            strcpy((char *)exif->gps_longitude_ref, "E");
         else
-            strcpy((char *)mExifInfo.gps_longitude_ref, "W");
+            strcpy((char *)exif->gps_longitude_ref, "W");
 
         if (m_gps_altitude > 0)
-            mExifInfo.gps_altitude_ref = 0;
+            exif->gps_altitude_ref = 0;
         else
-            mExifInfo.gps_altitude_ref = 1;
+            exif->gps_altitude_ref = 1;
 
         double latitude = fabs(m_gps_latitude / 10000.0);
         double longitude = fabs(m_gps_longitude / 10000.0);
         double altitude = fabs(m_gps_altitude / 100.0);
 
-        mExifInfo.gps_latitude[0].num = (uint32_t)latitude;
-        mExifInfo.gps_latitude[0].den = 1;
-        mExifInfo.gps_latitude[1].num = (uint32_t)((latitude - mExifInfo.gps_latitude[0].num) * 60);
-        mExifInfo.gps_latitude[1].den = 1;
-        mExifInfo.gps_latitude[2].num = (uint32_t)((((latitude - mExifInfo.gps_latitude[0].num) * 60)
-                                        - mExifInfo.gps_latitude[1].num) * 60);
-        mExifInfo.gps_latitude[2].den = 1;
-
-        mExifInfo.gps_longitude[0].num = (uint32_t)longitude;
-        mExifInfo.gps_longitude[0].den = 1;
-        mExifInfo.gps_longitude[1].num = (uint32_t)((longitude - mExifInfo.gps_longitude[0].num) * 60);
-        mExifInfo.gps_longitude[1].den = 1;
-        mExifInfo.gps_longitude[2].num = (uint32_t)((((longitude - mExifInfo.gps_longitude[0].num) * 60)
-                                        - mExifInfo.gps_longitude[1].num) * 60);
-        mExifInfo.gps_longitude[2].den = 1;
-
-        mExifInfo.gps_altitude.num = (uint32_t)altitude;
-        mExifInfo.gps_altitude.den = 1;
+        exif->gps_latitude[0].num = (uint32_t)latitude;
+        exif->gps_latitude[0].den = 1;
+        exif->gps_latitude[1].num = (uint32_t)((latitude - exif->gps_latitude[0].num) * 60);
+        exif->gps_latitude[1].den = 1;
+        exif->gps_latitude[2].num = (uint32_t)((((latitude - exif->gps_latitude[0].num) * 60)
+                                        - exif->gps_latitude[1].num) * 60);
+        exif->gps_latitude[2].den = 1;
+
+        exif->gps_longitude[0].num = (uint32_t)longitude;
+        exif->gps_longitude[0].den = 1;
+        exif->gps_longitude[1].num = (uint32_t)((longitude - exif->gps_longitude[0].num) * 60);
+        exif->gps_longitude[1].den = 1;
+        exif->gps_longitude[2].num = (uint32_t)((((longitude - exif->gps_longitude[0].num) * 60)
+                                        - exif->gps_longitude[1].num) * 60);
+        exif->gps_longitude[2].den = 1;
+
+        exif->gps_altitude.num = (uint32_t)altitude;
+        exif->gps_altitude.den = 1;
 
         struct tm tm_data;
         gmtime_r(&m_gps_timestamp, &tm_data);
-        mExifInfo.gps_timestamp[0].num = tm_data.tm_hour;
-        mExifInfo.gps_timestamp[0].den = 1;
-        mExifInfo.gps_timestamp[1].num = tm_data.tm_min;
-        mExifInfo.gps_timestamp[1].den = 1;
-        mExifInfo.gps_timestamp[2].num = tm_data.tm_sec;
-        mExifInfo.gps_timestamp[2].den = 1;
-        snprintf((char*)mExifInfo.gps_datestamp, sizeof(mExifInfo.gps_datestamp),
+        exif->gps_timestamp[0].num = tm_data.tm_hour;
+        exif->gps_timestamp[0].den = 1;
+        exif->gps_timestamp[1].num = tm_data.tm_min;
+        exif->gps_timestamp[1].den = 1;
+        exif->gps_timestamp[2].num = tm_data.tm_sec;
+        exif->gps_timestamp[2].den = 1;
+        snprintf((char*)exif->gps_datestamp, sizeof(exif->gps_datestamp),
                 "%04d:%02d:%02d", tm_data.tm_year + 1900, tm_data.tm_mon + 1, tm_data.tm_mday);
 
-        mExifInfo.enableGps = true;
+        exif->enableGps = true;
     } else {
-        mExifInfo.enableGps = false;
+        exif->enableGps = false;
     }
 
     //2 1th IFD TIFF Tags
-    mExifInfo.widthThumb = m_jpeg_thumbnail_width;
-    mExifInfo.heightThumb = m_jpeg_thumbnail_height;
+    exif->widthThumb = m_jpeg_thumbnail_width;
+    exif->heightThumb = m_jpeg_thumbnail_height;
 }
 
 // ======================================================================
@@ -37,6 +37,7 @@
 #include <videodev2_samsung.h>
 
 #include "JpegEncoder.h"
+#include "JpegService.h"
 
 #include <camera/CameraHardwareInterface.h>
 
@@ -291,12 +292,14 @@ public:
 
     int             startRecord(void);
     int             stopRecord(void);
-    int             getRecordFrame(void);
+    /* returns -EAGAIN when no frame came within a second */
+    int             getRecordFrame(nsecs_t *timestamp);
     int             releaseRecordFrame(int index);
     unsigned int    getRecPhyAddrY(int);
     unsigned int    getRecPhyAddrC(int);
 
     int             getPreview(void);
+    int             releasePreviewFrame(int index);
     int             setPreviewSize(int width, int height, int pixel_format);
     int             getPreviewSize(int *width, int *height, int *frame_size);
     int             getPreviewMaxSize(int *width, int *height);
@@ -366,6 +369,9 @@ public:
     int             setJpegQuality(int jpeg_qality);
     int             getJpegQuality(void);
 
+    int             setJpegTargetSize(int target_size);
+    int             getJpegTargetSize(void);
+
     int             setZoom(int zoom_level);
     int             getZoom(void);
 
@@ -433,7 +439,11 @@ public:
     unsigned char*  getJpeg(int*, unsigned int*);
     int             getSnapshotAndJpeg(unsigned char *yuv_buf, unsigned char *jpeg_buf,
                                         unsigned int *output_size);
-    int             getExif(unsigned char *pExifDst, unsigned char *pThumbSrc);
+    int             encodeSnapshot(unsigned char *yuv_buf, unsigned char *jpeg_buf,
+                                    unsigned int *output_size);
+    void            getExifAttributes(exif_attribute_t *exif);
+    int             getExif(unsigned char *pExifDst, unsigned char *pThumbSrc,
+                            exif_attribute_t *exif);
 
     void            getPostViewConfig(int*, int*, int*);
     void            getThumbnailConfig(int *width, int *height, int *size);
@@ -540,10 +550,14 @@ private:
 
     int             m_flag_camera_start;
 
+    /* preview buffers dequeued by getPreview() and not yet returned */
+    bool            m_preview_buf_held[MAX_BUFFERS];
+
     int             m_jpeg_fd;
     int             m_jpeg_thumbnail_width;
     int             m_jpeg_thumbnail_height;
     int             m_jpeg_quality;
+    int             m_jpeg_target_size;
 
     int             m_postview_offset;
 
@@ -551,17 +565,26 @@ private:
     int             m_esd_check_count;
 #endif // ENABLE_ESD_PREVIEW_CHECK
 
+    /* the attributes that don't change from shot to shot */
     exif_attribute_t mExifInfo;
+    ExifTemplate    mExifTemplate;
 
     struct fimc_buffer m_capture_buf;
     struct pollfd   m_events_c;
 
     inline int      m_frameSize(int format, int width, int height);
 
-    void            setExifChangedAttribute();
+    void            setExifChangedAttribute(exif_attribute_t *exif);
     void            setExifFixedAttribute();
+    void            setJpegEncoderConfig(JpegEncoder *jpgEnc);
     void            resetCamera();
 
+    /* work run on the JPEG service thread */
+    struct SnapshotJob;
+    struct ExifJob;
+    friend struct SnapshotJob;
+    friend struct ExifJob;
+
     static double   jpeg_ratio;
     static int      interleaveDataSize;
     static int      jpegLineLength;
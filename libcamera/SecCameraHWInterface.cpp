@@ -21,7 +21,10 @@
 #include <utils/Log.h>
 
 #include "SecCameraHWInterface.h"
+#include "YuvConvert.h"
 #include <utils/threads.h>
+#include <cutils/atomic.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <sys/mman.h>
 
@@ -65,6 +68,21 @@ static const int EFFECT_SKIP_FRAME = 1;
 CameraHardwareSec::CameraHardwareSec(int cameraId)
         :
           mCaptureInProgress(false),
+          mShutterTime(0),
+          mBurstCount(1),
+          mCaptureShots(1),
+          mBurstStop(false),
+          mCaptureMsgs(0),
+          mCaptureRefs(0),
+          mCaptureBufferJpegSize(0),
+          mCaptureBufferPostviewSize(0),
+          mCaptureBufferThumbSize(0),
+          mZslNext(0),
+          mZslFrameSize(0),
+          mZslLastUsed(0),
+          mZslEnabled(false),
+          mZslArmed(false),
+          mZslCapture(false),
           mParameters(),
           mPreviewHeap(0),
           mRawHeap(0),
@@ -73,9 +91,16 @@ CameraHardwareSec::CameraHardwareSec(int cameraId)
           mSecCamera(NULL),
           mCameraSensorName(NULL),
           mSkipFrame(0),
+          mPreviewBudget(0),
+          mPreviewBudgetMs(0),
+          mCallbackCost(0),
+          mOverlayCost(0),
+          mCallbackDivider(1),
+          mCallbackPhase(0),
 #if defined(BOARD_USES_OVERLAY)
           mUseOverlay(false),
           mOverlayBufferIdx(0),
+          mOverlayFrameIdx(-1),
 #endif
           mNotifyCb(0),
           mDataCb(0),
@@ -83,6 +108,8 @@ CameraHardwareSec::CameraHardwareSec(int cameraId)
           mCallbackCookie(0),
           mMsgEnabled(0),
           mRecordRunning(false),
+          mExitRecordThread(false),
+          mRecordFramesInFlight(0),
           mPostViewWidth(0),
           mPostViewHeight(0),
           mPostViewSize(0)
@@ -90,6 +117,13 @@ CameraHardwareSec::CameraHardwareSec(int cameraId)
     LOGV("%s :", __func__);
     int ret = 0;
 
+    memset(mPreviewFrameRefs, 0, sizeof(mPreviewFrameRefs));
+    memset(mZslTime, 0, sizeof(mZslTime));
+    for (int i = 0; i < kCaptureBufferCount; i++) {
+        mCaptureBuffers[i].busy = false;
+        mCaptureBuffers[i].stale = false;
+    }
+
     mSecCamera = SecCamera::createInstance();
 
     if (mSecCamera == NULL) {
@@ -125,6 +159,12 @@ CameraHardwareSec::CameraHardwareSec(int cameraId)
         mRawHeap.clear();
     }
 
+    mExifHeap = new MemoryHeapBase(EXIF_FILE_SIZE + JPG_STREAM_BUF_SIZE);
+    if (mExifHeap->getHeapID() < 0) {
+        LOGE("ERR(%s): Exif heap creation fail", __func__);
+        mExifHeap.clear();
+    }
+
     initDefaultParameters(cameraId);
 
     mExitAutoFocusThread = false;
@@ -134,8 +174,13 @@ CameraHardwareSec::CameraHardwareSec(int cameraId)
      */
     mPreviewRunning = false;
     mPreviewThread = new PreviewThread(this);
+    mRecordThread = new RecordThread(this);
     mAutoFocusThread = new AutoFocusThread(this);
     mPictureThread = new PictureThread(this);
+    mPostviewStage = new CaptureStage(this, &CameraHardwareSec::postviewStage,
+                                      "CameraPostviewThread");
+    mJpegStage = new CaptureStage(this, &CameraHardwareSec::jpegStage,
+                                  "CameraJpegThread");
 }
 
 void CameraHardwareSec::initDefaultParameters(int cameraId)
@@ -187,6 +232,13 @@ void CameraHardwareSec::initDefaultParameters(int cameraId)
     p.setPictureFormat(CameraParameters::PIXEL_FORMAT_JPEG);
     p.setPictureSize(snapshot_max_width, snapshot_max_height);
     p.set(CameraParameters::KEY_JPEG_QUALITY, "100"); // maximum quality
+    p.set("burst-capture", 1);
+    p.set("jpeg-target-size", 0);
+    p.set("max-burst-capture", kMaxBurstCount);
+    /* only used while preview, picture and postview sizes are equal */
+    p.set("zsl", "off");
+    p.set("preview-latency-budget", 0);
+    p.set("zsl-values", "off,on");
 
     p.set(CameraParameters::KEY_SUPPORTED_PREVIEW_FORMATS,
           CameraParameters::PIXEL_FORMAT_YUV420SP);
@@ -405,7 +457,8 @@ void CameraHardwareSec::disableMsgType(int32_t msgType)
 
 bool CameraHardwareSec::msgTypeEnabled(int32_t msgType)
 {
-    return (mMsgEnabled & msgType);
+    Mutex::Autolock lock(mStateLock);
+    return ((mMsgEnabled | mCaptureMsgs) & msgType);
 }
 
 // ---------------------------------------------------------------------------
@@ -418,6 +471,39 @@ void CameraHardwareSec::setSkipFrame(int frame)
     mSkipFrame = frame;
 }
 
+void CameraHardwareSec::acquirePreviewFrame(int index)
+{
+    Mutex::Autolock lock(mPreviewFrameLock);
+    if (mPreviewFrameRefs[index]++ == 0)
+        mPreviewFrameTime[index] = CameraTrace::now();
+}
+
+void CameraHardwareSec::releasePreviewFrame(int index)
+{
+    Mutex::Autolock lock(mPreviewFrameLock);
+    if (mPreviewFrameRefs[index] <= 0) {
+        LOGW("%s: buffer %d released more than acquired", __func__, index);
+        return;
+    }
+
+    if (--mPreviewFrameRefs[index] == 0) {
+        mSecCamera->releasePreviewFrame(index);
+        mTrace.record(CameraTrace::PREVIEW_HOLD, mPreviewFrameTime[index]);
+    }
+}
+
+/* forget every outstanding lease.  only called right before the preview
+ * is stopped, since streamoff returns all buffers to the driver anyway.
+ */
+void CameraHardwareSec::flushPreviewFrames(void)
+{
+    Mutex::Autolock lock(mPreviewFrameLock);
+    memset(mPreviewFrameRefs, 0, sizeof(mPreviewFrameRefs));
+#if defined(BOARD_USES_OVERLAY)
+    mOverlayFrameIdx = -1;
+#endif
+}
+
 int CameraHardwareSec::previewThreadWrapper()
 {
     LOGI("%s: starting", __func__);
@@ -425,6 +511,7 @@ int CameraHardwareSec::previewThreadWrapper()
         mPreviewLock.lock();
         while (!mPreviewRunning) {
             LOGI("%s: calling mSecCamera->stopPreview() and waiting", __func__);
+            flushPreviewFrames();
             mSecCamera->stopPreview();
             /* signal that we're stopping */
             mPreviewStoppedCondition.signal();
@@ -435,6 +522,7 @@ int CameraHardwareSec::previewThreadWrapper()
 
         if (mExitPreviewThread) {
             LOGI("%s: exiting", __func__);
+            flushPreviewFrames();
             mSecCamera->stopPreview();
             return 0;
         }
@@ -448,17 +536,22 @@ int CameraHardwareSec::previewThread()
     nsecs_t timestamp;
     unsigned int phyYAddr;
     unsigned int phyCAddr;
-    struct addrs *addrs;
 
     index = mSecCamera->getPreview();
     if (index < 0) {
         LOGE("ERR(%s):Fail on SecCamera->getPreview()", __func__);
+        mTrace.frameDropped();
         return UNKNOWN_ERROR;
     }
+    /* hold the frame for the duration of this pass */
+    acquirePreviewFrame(index);
+    mTrace.previewFrame(CameraTrace::now());
+
     mSkipFrameLock.lock();
     if (mSkipFrame > 0) {
         mSkipFrame--;
         mSkipFrameLock.unlock();
+        releasePreviewFrame(index);
         return NO_ERROR;
     }
     mSkipFrameLock.unlock();
@@ -470,6 +563,7 @@ int CameraHardwareSec::previewThread()
 
     if (phyYAddr == 0xffffffff || phyCAddr == 0xffffffff) {
         LOGE("ERR(%s):Fail on SecCamera getPhyAddr Y addr = %0x C addr = %0x", __func__, phyYAddr, phyCAddr);
+        releasePreviewFrame(index);
         return UNKNOWN_ERROR;
      }
 
@@ -483,10 +577,13 @@ int CameraHardwareSec::previewThread()
     memcpy(static_cast<unsigned char *>(mPreviewHeap->base()) + (offset + frame_size    ), &phyYAddr, 4);
     memcpy(static_cast<unsigned char *>(mPreviewHeap->base()) + (offset + frame_size + 4), &phyCAddr, 4);
 
+    storeZslFrame(static_cast<unsigned char *>(mPreviewHeap->base()) + offset, frame_size, timestamp);
+
 #if defined(BOARD_USES_OVERLAY)
     if (mUseOverlay) {
         int ret;
         overlay_buffer_t overlay_buffer;
+        nsecs_t overlay_start = CameraTrace::now();
 
         mOverlayBufferIdx ^= 1;
         memcpy(static_cast<unsigned char*>(mPreviewHeap->base()) + offset + frame_size + sizeof(phyYAddr) + sizeof(phyCAddr),
@@ -496,49 +593,140 @@ int CameraHardwareSec::previewThread()
 
         if (ret == -1 ) {
             LOGE("ERR(%s):overlay queueBuffer fail", __func__);
-        } else if (ret != ALL_BUFFERS_FLUSHED) {
-            ret = mOverlay->dequeueBuffer(&overlay_buffer);
-            if (ret == -1) {
-                LOGE("ERR(%s):overlay dequeueBuffer fail", __func__);
+        } else {
+            /* the overlay scans out from the camera buffer, so keep it
+             * until the next frame replaces it on screen.
+             */
+            acquirePreviewFrame(index);
+            if (mOverlayFrameIdx >= 0)
+                releasePreviewFrame(mOverlayFrameIdx);
+            mOverlayFrameIdx = index;
+
+            if (ret != ALL_BUFFERS_FLUSHED) {
+                ret = mOverlay->dequeueBuffer(&overlay_buffer);
+                if (ret == -1) {
+                    LOGE("ERR(%s):overlay dequeueBuffer fail", __func__);
+                }
             }
          }
+        mTrace.record(CameraTrace::OVERLAY_QUEUE, overlay_start);
+        mOverlayCost += (CameraTrace::now() - overlay_start - mOverlayCost) / 8;
+     } else if (mOverlayFrameIdx >= 0) {
+        /* overlay went away while holding a frame */
+        releasePreviewFrame(mOverlayFrameIdx);
+        mOverlayFrameIdx = -1;
      }
 #endif
 
-    // Notify the client of a new frame.
+    // Notify the client of a new frame.  The callback runs synchronously,
+    // so the frame stays leased to it until mDataCb returns.
     if (mMsgEnabled & CAMERA_MSG_PREVIEW_FRAME) {
-        mDataCb(CAMERA_MSG_PREVIEW_FRAME, buffer, mCallbackCookie);
+        if (++mCallbackPhase >= mCallbackDivider) {
+            nsecs_t callback_start = CameraTrace::now();
+            mCallbackPhase = 0;
+            mDataCb(CAMERA_MSG_PREVIEW_FRAME, buffer, mCallbackCookie);
+            mTrace.record(CameraTrace::PREVIEW_CALLBACK, callback_start);
+            updatePreviewGovernor(CameraTrace::now() - callback_start);
+        } else {
+            mTrace.callbackSkipped();
+        }
     }
 
-    Mutex::Autolock lock(mRecordLock);
-    if (mRecordRunning == true) {
-        index = mSecCamera->getRecordFrame();
-        if (index < 0) {
-            LOGE("ERR(%s):Fail on SecCamera->getRecord()", __func__);
-            return UNKNOWN_ERROR;
-        }
+    releasePreviewFrame(index);
+
+    return NO_ERROR;
+}
 
-        phyYAddr = mSecCamera->getRecPhyAddrY(index);
-        phyCAddr = mSecCamera->getRecPhyAddrC(index);
+/* called with the cost of each delivered preview callback.  the divider
+ * moves one step at a time, and only comes down again once the callback
+ * fits the budget with some room to spare.
+ */
+void CameraHardwareSec::updatePreviewGovernor(nsecs_t callbackCost)
+{
+    mCallbackCost += (callbackCost - mCallbackCost) / 8;
 
-        if (phyYAddr == 0xffffffff || phyCAddr == 0xffffffff) {
-            LOGE("ERR(%s):Fail on SecCamera getRectPhyAddr Y addr = %0x C addr = %0x", __func__, phyYAddr, phyCAddr);
-            return UNKNOWN_ERROR;
-        }
+    nsecs_t budget = mPreviewBudget - mOverlayCost;
+    if (budget <= 0)
+        budget = 1;
 
-        addrs = (struct addrs *)mRecordHeap->base();
+    int divider = mCallbackDivider;
+    if (mCallbackCost > budget * divider && divider < kMaxCallbackDivider)
+        divider++;
+    else if (divider > 1 && mCallbackCost * 5 < budget * (divider - 1) * 4)
+        divider--;
 
-        sp<MemoryBase> buffer = new MemoryBase(mRecordHeap, index * sizeof(struct addrs), sizeof(struct addrs));
-        addrs[index].addr_y = phyYAddr;
-        addrs[index].addr_cbcr = phyCAddr;
-        addrs[index].buf_index = index;
+    if (divider != mCallbackDivider) {
+        LOGI("%s: preview callback takes %lld us, delivering 1 of %d frames",
+             __func__, mCallbackCost / 1000, divider);
+        mCallbackDivider = divider;
+    }
+}
 
-        // Notify the client of a new frame.
-        if (mMsgEnabled & CAMERA_MSG_VIDEO_FRAME) {
-            mDataCbTimestamp(timestamp, CAMERA_MSG_VIDEO_FRAME, buffer, mCallbackCookie);
-        } else {
-            mSecCamera->releaseRecordFrame(index);
+int CameraHardwareSec::recordThreadWrapper()
+{
+    LOGI("%s: starting", __func__);
+    while (1) {
+        mRecordLock.lock();
+        while (!mRecordRunning && !mExitRecordThread) {
+            /* signal that we're out of the driver */
+            mRecordStoppedCondition.signal();
+            mRecordCondition.wait(mRecordLock);
+        }
+        mRecordLock.unlock();
+
+        if (mExitRecordThread) {
+            LOGI("%s: exiting", __func__);
+            return 0;
         }
+        recordThread();
+    }
+}
+
+/* the record node runs at its own pace, so its frames are serviced here
+ * rather than after each preview frame.
+ */
+int CameraHardwareSec::recordThread()
+{
+    int index;
+    nsecs_t timestamp;
+    unsigned int phyYAddr;
+    unsigned int phyCAddr;
+    struct addrs *addrs;
+
+    nsecs_t record_start = CameraTrace::now();
+    index = mSecCamera->getRecordFrame(&timestamp);
+    if (index == -EAGAIN) {
+        // idle or paused, go round again
+        return NO_ERROR;
+    }
+    if (index < 0) {
+        LOGE("ERR(%s):Fail on SecCamera->getRecordFrame()", __func__);
+        return UNKNOWN_ERROR;
+    }
+    mTrace.record(CameraTrace::RECORD_DQBUF, record_start);
+
+    phyYAddr = mSecCamera->getRecPhyAddrY(index);
+    phyCAddr = mSecCamera->getRecPhyAddrC(index);
+
+    if (phyYAddr == 0xffffffff || phyCAddr == 0xffffffff) {
+        LOGE("ERR(%s):Fail on SecCamera getRectPhyAddr Y addr = %0x C addr = %0x", __func__, phyYAddr, phyCAddr);
+        mSecCamera->releaseRecordFrame(index);
+        return UNKNOWN_ERROR;
+    }
+
+    addrs = (struct addrs *)mRecordHeap->base();
+
+    sp<MemoryBase> buffer = new MemoryBase(mRecordHeap, index * sizeof(struct addrs), sizeof(struct addrs));
+    addrs[index].addr_y = phyYAddr;
+    addrs[index].addr_cbcr = phyCAddr;
+    addrs[index].buf_index = index;
+
+    // Notify the client of a new frame.
+    if (mMsgEnabled & CAMERA_MSG_VIDEO_FRAME) {
+        android_atomic_inc(&mRecordFramesInFlight);
+        mDataCbTimestamp(timestamp, CAMERA_MSG_VIDEO_FRAME, buffer, mCallbackCookie);
+    } else {
+        mSecCamera->releaseRecordFrame(index);
     }
 
     return NO_ERROR;
@@ -589,6 +777,27 @@ status_t CameraHardwareSec::startPreview()
     mSecCamera->getPostViewConfig(&mPostViewWidth, &mPostViewHeight, &mPostViewSize);
     LOGV("CameraHardwareSec: mPostViewWidth = %d mPostViewHeight = %d mPostViewSize = %d",mPostViewWidth,mPostViewHeight,mPostViewSize);
 
+    if (mZslEnabled && isZslCapable())
+        allocZslFrames(frame_size);
+    else
+        clearZslFrames();
+    if (mZslEnabled && !isZslCapable())
+        LOGI("%s : zsl needs preview, picture and postview at one size, "
+             "capturing from the sensor", __func__);
+
+    mTrace.previewStarted();
+
+    if (mPreviewBudgetMs > 0)
+        mPreviewBudget = milliseconds(mPreviewBudgetMs);
+    else if (mParameters.getPreviewFrameRate() > 0)
+        mPreviewBudget = seconds(1) / mParameters.getPreviewFrameRate();
+    else
+        mPreviewBudget = milliseconds(33);
+    mCallbackCost = 0;
+    mOverlayCost = 0;
+    mCallbackDivider = 1;
+    mCallbackPhase = 0;
+
     mPreviewRunning = true;
     mPreviewCondition.signal();
     mPreviewLock.unlock();
@@ -670,6 +879,8 @@ void CameraHardwareSec::stopPreview()
         LOGI("%s : preview not running, doing nothing", __func__);
     }
     mPreviewLock.unlock();
+
+    clearZslFrames();
 }
 
 bool CameraHardwareSec::previewEnabled()
@@ -693,6 +904,7 @@ status_t CameraHardwareSec::startRecording()
             return UNKNOWN_ERROR;
         }
         mRecordRunning = true;
+        mRecordCondition.signal();
     }
     return NO_ERROR;
 }
@@ -704,11 +916,16 @@ void CameraHardwareSec::stopRecording()
     Mutex::Autolock lock(mRecordLock);
 
     if (mRecordRunning == true) {
+        mRecordRunning = false;
+        /* the record thread may be waiting on the node, let it get out
+         * before the stream goes away
+         */
+        mRecordCondition.signal();
+        mRecordStoppedCondition.wait(mRecordLock);
         if (mSecCamera->stopRecord() < 0) {
             LOGE("ERR(%s):Fail on mSecCamera->stopRecord()", __func__);
             return;
         }
-        mRecordRunning = false;
     }
 }
 
@@ -725,6 +942,7 @@ void CameraHardwareSec::releaseRecordingFrame(const sp<IMemory>& mem)
     sp<IMemoryHeap> heap = mem->getMemory(&offset, NULL);
     struct addrs *addrs = (struct addrs *)((uint8_t *)heap->base() + offset);
 
+    android_atomic_dec(&mRecordFramesInFlight);
     mSecCamera->releaseRecordFrame(addrs->buf_index);
 }
 
@@ -794,6 +1012,8 @@ int CameraHardwareSec::autoFocusThread()
 status_t CameraHardwareSec::autoFocus()
 {
     LOGV("%s :", __func__);
+    /* a picture is likely to follow, start keeping frames for it */
+    armZslFrames();
     /* signal autoFocusThread to run once */
     mFocusCondition.signal();
     return NO_ERROR;
@@ -804,6 +1024,11 @@ status_t CameraHardwareSec::cancelAutoFocus()
 {
     LOGV("%s :", __func__);
 
+    mStateLock.lock();
+    if (!mCaptureInProgress)
+        disarmZslFrames();
+    mStateLock.unlock();
+
     if (mSecCamera->cancelAutofocus() < 0) {
         LOGE("ERR(%s):Fail on mSecCamera->cancelAutofocus()", __func__);
         return UNKNOWN_ERROR;
@@ -877,124 +1102,128 @@ void CameraHardwareSec::save_postview(const char *fname, uint8_t *buf, uint32_t
     ::close(fd);
 }
 
-bool CameraHardwareSec::scaleDownYuv422(char *srcBuf, uint32_t srcWidth, uint32_t srcHeight,
-                                        char *dstBuf, uint32_t dstWidth, uint32_t dstHeight)
+/* capture stage: takes mCaptureShots stills back to back.  the preview
+ * stays stopped for the whole burst and every shot goes into one of the
+ * persistent capture buffers.
+ */
+int CameraHardwareSec::pictureThread()
 {
-    int32_t step_x, step_y;
-    int32_t iXsrc, iXdst;
-    int32_t x, y, src_y_start_pos, dst_pos, src_pos;
-
-    if (dstWidth % 2 != 0 || dstHeight % 2 != 0){
-        LOGE("scale_down_yuv422: invalid width, height for scaling");
-        return false;
-    }
-
-    step_x = srcWidth / dstWidth;
-    step_y = srcHeight / dstHeight;
-
-    dst_pos = 0;
-    for (uint32_t y = 0; y < dstHeight; y++) {
-        src_y_start_pos = (y * step_y * (srcWidth * 2));
+    LOGV("%s :", __func__);
 
-        for (uint32_t x = 0; x < dstWidth; x += 2) {
-            src_pos = src_y_start_pos + (x * (step_x * 2));
+    int ret = NO_ERROR;
+    int shots = mCaptureShots;
+    int taken;
+    bool stop;
+    int jpeg_heap_size, postview_size, thumb_size;
+    nsecs_t start = systemTime(SYSTEM_TIME_MONOTONIC);
+    nsecs_t shutter;
+
+    /* no-op unless the postview or thumbnail size changed */
+    getCaptureBufferSizes(&jpeg_heap_size, &postview_size, &thumb_size);
+    allocCaptureBuffers(jpeg_heap_size, postview_size, thumb_size);
+
+    for (taken = 0; taken < shots; taken++) {
+        mStateLock.lock();
+        stop = mBurstStop;
+        mStateLock.unlock();
+        if (stop) {
+            LOGI("%s: burst stopped after %d shots", __func__, taken);
+            break;
+        }
+        if (taken && !(mCaptureMsgs & CAMERA_MSG_COMPRESSED_IMAGE)) {
+            LOGI("%s: no one wants the jpegs, burst stopped after %d shots",
+                 __func__, taken);
+            break;
+        }
 
-            dstBuf[dst_pos++] = srcBuf[src_pos    ];
-            dstBuf[dst_pos++] = srcBuf[src_pos + 1];
-            dstBuf[dst_pos++] = srcBuf[src_pos + 2];
-            dstBuf[dst_pos++] = srcBuf[src_pos + 3];
+        /* later shots of a burst start when the previous one is done */
+        if (taken) {
+            mTrace.record(CameraTrace::BURST_INTERVAL, shutter);
+            shutter = systemTime(SYSTEM_TIME_MONOTONIC);
+        } else {
+            shutter = mShutterTime;
         }
+        if (mZslCapture) {
+            ret = zslShot(shutter);
+        } else {
+            ret = captureShot(shutter);
+            /* hand the capture buffer back before the next shot */
+            mSecCamera->endSnapshot();
+        }
+        if (ret != NO_ERROR)
+            break;
     }
 
-    return true;
-}
-
-bool CameraHardwareSec::YUY2toNV21(void *srcBuf, void *dstBuf, uint32_t srcWidth, uint32_t srcHeight)
-{
-    int32_t        x, y, src_y_start_pos, dst_cbcr_pos, dst_pos, src_pos;
-    unsigned char *srcBufPointer = (unsigned char *)srcBuf;
-    unsigned char *dstBufPointer = (unsigned char *)dstBuf;
-
-    dst_pos = 0;
-    dst_cbcr_pos = srcWidth*srcHeight;
-    for (uint32_t y = 0; y < srcHeight; y++) {
-        src_y_start_pos = (y * (srcWidth * 2));
-
-        for (uint32_t x = 0; x < (srcWidth * 2); x += 2) {
-            src_pos = src_y_start_pos + x;
-
-            dstBufPointer[dst_pos++] = srcBufPointer[src_pos];
-        }
+    if (shots > 1) {
+        nsecs_t elapsed = systemTime(SYSTEM_TIME_MONOTONIC) - start;
+        LOGI("%s: burst of %d shots in %lld ms (%.2f fps)", __func__, taken,
+             elapsed / 1000000LL, elapsed ? taken * 1e9 / elapsed : 0.0);
     }
-    for (uint32_t y = 0; y < srcHeight; y += 2) {
-        src_y_start_pos = (y * (srcWidth * 2));
 
-        for (uint32_t x = 0; x < (srcWidth * 2); x += 4) {
-            src_pos = src_y_start_pos + x;
+    if (mZslCapture)
+        disarmZslFrames();
 
-            dstBufPointer[dst_cbcr_pos++] = srcBufPointer[src_pos + 3];
-            dstBufPointer[dst_cbcr_pos++] = srcBufPointer[src_pos + 1];
-        }
-    }
+    mStateLock.lock();
+    mCaptureInProgress = false;
+    mStateLock.unlock();
+    putCaptureRef();
 
-    return true;
+    return ret;
 }
 
-int CameraHardwareSec::pictureThread()
+/* trigger the sensor, pull the frame out of the capture buffer and hand
+ * it to the postview stage, so the next shot can be captured while this
+ * one is still being processed downstream.
+ */
+int CameraHardwareSec::captureShot(nsecs_t shutterTime)
 {
     LOGV("%s :", __func__);
 
     int jpeg_size = 0;
     int ret = NO_ERROR;
     unsigned char *jpeg_data = NULL;
-    int postview_offset = 0;
-    unsigned char *postview_data = NULL;
 
-    unsigned char *addr = NULL;
-    int mPostViewWidth, mPostViewHeight, mPostViewSize;
-    int mThumbWidth, mThumbHeight, mThumbSize;
-    int cap_width, cap_height, cap_frame_size;
+    int thumb_size;
 
     unsigned int output_size = 0;
 
-    mSecCamera->getPostViewConfig(&mPostViewWidth, &mPostViewHeight, &mPostViewSize);
-    mSecCamera->getThumbnailConfig(&mThumbWidth, &mThumbHeight, &mThumbSize);
-    int postviewHeapSize = mPostViewSize;
-    mSecCamera->getSnapshotSize(&cap_width, &cap_height, &cap_frame_size);
-    int mJpegHeapSize;
-    if (mSecCamera->getCameraId() == SecCamera::CAMERA_ID_BACK)
-        mJpegHeapSize = cap_frame_size * SecCamera::getJpegRatio();
-    else
-        mJpegHeapSize = cap_frame_size;
+    CaptureJob *job = new CaptureJob;
+
+    mSecCamera->getPostViewConfig(&job->postviewWidth, &job->postviewHeight, &job->postviewSize);
+    mSecCamera->getThumbnailConfig(&job->thumbWidth, &job->thumbHeight, &thumb_size);
 
+    nsecs_t stage_start = CameraTrace::now();
     LOG_TIME_DEFINE(0)
     LOG_TIME_START(0)
-    sp<MemoryBase> buffer = new MemoryBase(mRawHeap, 0, mPostViewSize + 8);
-
-    struct addrs_cap *addrs = (struct addrs_cap *)mRawHeap->base();
-
-    addrs[0].width = mPostViewWidth;
-    addrs[0].height = mPostViewHeight;
-    LOGV("[5B] mPostViewWidth = %d mPostViewHeight = %d\n",mPostViewWidth,mPostViewHeight);
 
-    sp<MemoryHeapBase> JpegHeap = new MemoryHeapBase(mJpegHeapSize);
-    sp<MemoryHeapBase> PostviewHeap = new MemoryHeapBase(mPostViewSize);
-    sp<MemoryHeapBase> ThumbnailHeap = new MemoryHeapBase(mThumbSize);
+    job->jpegImageSize = 0;
+    job->bufferIndex = -1;
+    job->shutterTime = shutterTime;
+    job->zsl = false;
+    mStateLock.lock();
+    job->msgs = mCaptureMsgs;
+    mCaptureRefs++;
+    mStateLock.unlock();
+    if (getCaptureBuffer(job) < 0) {
+        LOGE("ERR(%s):no capture buffer", __func__);
+        ret = NO_MEMORY;
+        goto out;
+    }
 
-    if (mMsgEnabled & CAMERA_MSG_RAW_IMAGE) {
+    /* not gated on CAMERA_MSG_RAW_IMAGE: the service turns that off
+     * after the first raw callback, and later shots of a burst still
+     * have to be captured
+     */
+    {
         LOG_TIME_DEFINE(1)
         LOG_TIME_START(1)
 
-        int picture_size, picture_width, picture_height;
-        mSecCamera->getSnapshotSize(&picture_width, &picture_height, &picture_size);
-        int picture_format = mSecCamera->getSnapshotPixelFormat();
-
         unsigned int phyAddr;
 
         // Modified the shutter sound timing for Jpeg capture
         if (mSecCamera->getCameraId() == SecCamera::CAMERA_ID_BACK)
             mSecCamera->setSnapshotCmd();
-        if (mMsgEnabled & CAMERA_MSG_SHUTTER) {
+        if (job->msgs & CAMERA_MSG_SHUTTER) {
             mNotifyCb(CAMERA_MSG_SHUTTER, 0, 0, mCallbackCookie);
         }
 
@@ -1003,14 +1232,14 @@ int CameraHardwareSec::pictureThread()
             if (jpeg_data == NULL) {
                 LOGE("ERR(%s):Fail on SecCamera->getSnapshot()", __func__);
                 ret = UNKNOWN_ERROR;
+                goto out;
             }
         } else {
-            if (mSecCamera->getSnapshotAndJpeg((unsigned char*)PostviewHeap->base(),
-                    (unsigned char*)JpegHeap->base(), &output_size) < 0) {
-                mStateLock.lock();
-                mCaptureInProgress = false;
-                mStateLock.unlock();
-                return UNKNOWN_ERROR;
+            ret = mSecCamera->getSnapshotAndJpeg((unsigned char*)job->postviewHeap->base(),
+                    (unsigned char*)job->jpegHeap->base() + kExifReserveSize, &output_size);
+            if (ret < 0) {
+                ret = UNKNOWN_ERROR;
+                goto out;
             }
             LOGI("snapshotandjpeg done\n");
         }
@@ -1019,80 +1248,351 @@ int CameraHardwareSec::pictureThread()
         LOG_CAMERA("getSnapshotAndJpeg interval: %lu us", LOG_TIME(1));
     }
 
-    int JpegImageSize, JpegExifSize;
-    bool isLSISensor = false;
+    /* the settings can change once this shot is done, before the jpeg
+     * stage gets to it
+     */
+    mSecCamera->getExifAttributes(&job->exif);
 
     if (mSecCamera->getCameraId() == SecCamera::CAMERA_ID_BACK) {
-        isLSISensor = !strncmp((const char*)mCameraSensorName, "S5K4ECGX", 8);
+        bool isLSISensor = !strncmp((const char*)mCameraSensorName, "S5K4ECGX", 8);
+        LOG_TIME_DEFINE(2)
+        LOG_TIME_START(2)
         if(isLSISensor) {
             LOGI("== Camera Sensor Detect %s - Samsung LSI SOC 5M ==\n", mCameraSensorName);
             // LSI 5M SOC
             if (!SplitFrame(jpeg_data, SecCamera::getInterleaveDataSize(),
                        SecCamera::getJpegLineLength(),
-                       mPostViewWidth * 2, mPostViewWidth,
-                       JpegHeap->base(), &JpegImageSize,
-                       PostviewHeap->base(), &mPostViewSize))
-                return UNKNOWN_ERROR;
+                       job->postviewWidth * 2, job->postviewWidth,
+                       (unsigned char *)job->jpegHeap->base() + kExifReserveSize,
+                       &job->jpegImageSize,
+                       job->postviewHeap->base(), &job->postviewSize)) {
+                ret = UNKNOWN_ERROR;
+                goto out;
+            }
         } else {
             LOGI("== Camera Sensor Detect %s Sony SOC 5M ==\n", mCameraSensorName);
-            decodeInterleaveData(jpeg_data, SecCamera::getInterleaveDataSize(), mPostViewWidth, mPostViewHeight,
-                                &JpegImageSize, JpegHeap->base(), PostviewHeap->base());
+            decodeInterleaveData(jpeg_data, SecCamera::getInterleaveDataSize(),
+                                job->postviewWidth, job->postviewHeight,
+                                &job->jpegImageSize,
+                                (unsigned char *)job->jpegHeap->base() + kExifReserveSize,
+                                job->postviewHeap->base());
 
         }
+        LOG_TIME_END(2)
+        LOG_CAMERA("demux %d bytes: %lu us (%llu bytes/s)", SecCamera::getInterleaveDataSize(),
+                   LOG_TIME(2), SecCamera::getInterleaveDataSize() * 1000000ULL / (LOG_TIME(2) + 1));
     } else {
-        JpegImageSize = static_cast<int>(output_size);
+        job->jpegImageSize = static_cast<int>(output_size);
+    }
+
+    LOG_TIME_END(0)
+    LOG_CAMERA("capture stage interval: %lu us", LOG_TIME(0));
+    mTrace.record(CameraTrace::CAPTURE_STAGE, stage_start);
+
+    mPostviewStage->queueJob(job);
+    return NO_ERROR;
+
+out:
+    releaseCaptureJob(job);
+    return ret;
+}
+
+/* zero shutter lag shot: encode the ring frame nearest to the shutter.
+ * the preview keeps running, so there is no sensor mode switch and no
+ * snapshot buffer to give back.
+ */
+int CameraHardwareSec::zslShot(nsecs_t shutterTime)
+{
+    LOGV("%s :", __func__);
+
+    int ret = NO_ERROR;
+    int thumb_size;
+    int slot;
+    unsigned int output_size = 0;
+
+    CaptureJob *job = new CaptureJob;
+
+    mSecCamera->getPostViewConfig(&job->postviewWidth, &job->postviewHeight, &job->postviewSize);
+    mSecCamera->getThumbnailConfig(&job->thumbWidth, &job->thumbHeight, &thumb_size);
+
+    nsecs_t stage_start = CameraTrace::now();
+    LOG_TIME_DEFINE(0)
+    LOG_TIME_START(0)
+
+    job->jpegImageSize = 0;
+    job->bufferIndex = -1;
+    job->shutterTime = shutterTime;
+    job->zsl = true;
+    mStateLock.lock();
+    job->msgs = mCaptureMsgs;
+    mCaptureRefs++;
+    mStateLock.unlock();
+    if (getCaptureBuffer(job) < 0) {
+        LOGE("ERR(%s):no capture buffer", __func__);
+        ret = NO_MEMORY;
+        goto out;
+    }
+
+    if (job->msgs & CAMERA_MSG_SHUTTER) {
+        mNotifyCb(CAMERA_MSG_SHUTTER, 0, 0, mCallbackCookie);
+    }
+
+    mZslLock.lock();
+    slot = findZslFrame_l(shutterTime);
+    if (slot < 0 && mZslHeap != NULL) {
+        /* armed just now or a burst has used up the ring, wait for the
+         * next frame
+         */
+        mZslCondition.waitRelative(mZslLock, milliseconds(200));
+        slot = findZslFrame_l(shutterTime);
+    }
+    if (slot < 0) {
+        mZslLock.unlock();
+        LOGE("ERR(%s):no zsl frame", __func__);
+        ret = UNKNOWN_ERROR;
+        goto out;
+    }
+    mZslLastUsed = mZslTime[slot];
+    LOGV("%s : frame %lld us from shutter", __func__, (mZslTime[slot] - shutterTime) / 1000);
+    nv21ToYuyv((uint8_t *)mZslHeap->base() + slot * mZslFrameSize,
+               (uint8_t *)job->postviewHeap->base(), job->postviewWidth, job->postviewHeight);
+    mZslLock.unlock();
+
+    mSecCamera->getExifAttributes(&job->exif);
+    ret = mSecCamera->encodeSnapshot((unsigned char *)job->postviewHeap->base(),
+            (unsigned char *)job->jpegHeap->base() + kExifReserveSize, &output_size);
+    if (ret < 0) {
+        LOGE("ERR(%s):Fail on mSecCamera->encodeSnapshot()", __func__);
+        ret = UNKNOWN_ERROR;
+        goto out;
+    }
+    job->jpegImageSize = static_cast<int>(output_size);
+
+    LOG_TIME_END(0)
+    LOG_CAMERA("zsl capture stage interval: %lu us", LOG_TIME(0));
+    mTrace.record(CameraTrace::CAPTURE_STAGE, stage_start);
+
+    mPostviewStage->queueJob(job);
+    return NO_ERROR;
+
+out:
+    releaseCaptureJob(job);
+    return ret;
+}
+
+/* the ring holds preview frames as they are, so it only works when they
+ * are NV21 at both the picture and the postview size.
+ */
+bool CameraHardwareSec::isZslCapable(void)
+{
+    int preview_width, preview_height, preview_size;
+    int snapshot_width, snapshot_height, snapshot_size;
+    int postview_width, postview_height, postview_size;
+
+    mSecCamera->getPreviewSize(&preview_width, &preview_height, &preview_size);
+    mSecCamera->getSnapshotSize(&snapshot_width, &snapshot_height, &snapshot_size);
+    mSecCamera->getPostViewConfig(&postview_width, &postview_height, &postview_size);
+
+    return mSecCamera->getPreviewPixelFormat() == V4L2_PIX_FMT_NV21 &&
+           preview_width == snapshot_width && preview_height == snapshot_height &&
+           preview_width == postview_width && preview_height == postview_height;
+}
+
+void CameraHardwareSec::allocZslFrames(int frameSize)
+{
+    Mutex::Autolock lock(mZslLock);
+
+    memset(mZslTime, 0, sizeof(mZslTime));
+    mZslNext = 0;
+    mZslLastUsed = 0;
+    mZslArmed = false;
+
+    if (mZslHeap != NULL && mZslFrameSize == frameSize)
+        return;
+
+    mZslHeap.clear();
+    mZslFrameSize = frameSize;
+    LOGV("mZslHeap : MemoryHeapBase(%d)", frameSize * kZslHistoryDepth);
+    mZslHeap = new MemoryHeapBase(frameSize * kZslHistoryDepth);
+    if (mZslHeap->getHeapID() < 0) {
+        LOGE("ERR(%s): Zsl heap creation fail", __func__);
+        mZslHeap.clear();
+    }
+}
+
+void CameraHardwareSec::storeZslFrame(const void *frame, int size, nsecs_t time)
+{
+    Mutex::Autolock lock(mZslLock);
+
+    /* no one is about to take a picture, spare the copy */
+    if (!mZslArmed || mZslHeap == NULL || size != mZslFrameSize)
+        return;
+
+    memcpy((uint8_t *)mZslHeap->base() + mZslNext * mZslFrameSize, frame, size);
+    mZslTime[mZslNext] = time;
+    mZslNext = (mZslNext + 1) % kZslHistoryDepth;
+    mZslCondition.signal();
+}
+
+/* start filling the ring.  frames from an earlier arming are too old to
+ * be used.  false if there is no ring, the capture then comes from the
+ * sensor.
+ */
+bool CameraHardwareSec::armZslFrames(void)
+{
+    Mutex::Autolock lock(mZslLock);
+
+    if (mZslHeap == NULL)
+        return false;
+
+    if (!mZslArmed) {
+        memset(mZslTime, 0, sizeof(mZslTime));
+        mZslNext = 0;
+        mZslLastUsed = 0;
+        mZslArmed = true;
+    }
+
+    return true;
+}
+
+void CameraHardwareSec::disarmZslFrames(void)
+{
+    Mutex::Autolock lock(mZslLock);
+
+    mZslArmed = false;
+}
+
+/* the unused frame nearest to time, or -1 */
+int CameraHardwareSec::findZslFrame_l(nsecs_t time)
+{
+    int best = -1;
+    nsecs_t best_distance = 0;
+
+    if (mZslHeap == NULL)
+        return -1;
+
+    for (int i = 0; i < kZslHistoryDepth; i++) {
+        if (mZslTime[i] == 0 || mZslTime[i] <= mZslLastUsed)
+            continue;
+
+        nsecs_t distance = mZslTime[i] > time ? mZslTime[i] - time : time - mZslTime[i];
+        if (best < 0 || distance < best_distance) {
+            best = i;
+            best_distance = distance;
+        }
     }
-    scaleDownYuv422((char *)PostviewHeap->base(), mPostViewWidth, mPostViewHeight,
-                    (char *)ThumbnailHeap->base(), mThumbWidth, mThumbHeight);
 
-    memcpy(mRawHeap->base(),PostviewHeap->base(), postviewHeapSize);
+    return best;
+}
+
+void CameraHardwareSec::clearZslFrames(void)
+{
+    Mutex::Autolock lock(mZslLock);
+
+    mZslHeap.clear();
+    memset(mZslTime, 0, sizeof(mZslTime));
+    mZslNext = 0;
+    mZslLastUsed = 0;
+    mZslArmed = false;
+    mZslCondition.signal();
+}
+
+/* postview stage: thumbnail, raw callback and the postview on the overlay */
+int CameraHardwareSec::postviewStage(CaptureJob *job)
+{
+    LOGV("%s :", __func__);
+
+    nsecs_t stage_start = CameraTrace::now();
+    LOG_TIME_DEFINE(0)
+    LOG_TIME_START(0)
+
+    sp<MemoryBase> buffer = new MemoryBase(mRawHeap, 0, job->postviewSize + 8);
+
+    struct addrs_cap *addrs = (struct addrs_cap *)mRawHeap->base();
+
+    addrs[0].width = job->postviewWidth;
+    addrs[0].height = job->postviewHeight;
+    LOGV("[5B] postviewWidth = %d postviewHeight = %d\n", job->postviewWidth, job->postviewHeight);
 
+    uint8_t *overlay_frame = NULL;
 #if defined(BOARD_USES_OVERLAY)
-   /* Put postview image to Overlay */
+    /* Put postview image to Overlay.  the preview heap belongs to the
+     * preview thread again once the preview has been restarted.
+     */
     unsigned int index = 0;
-    unsigned int offset = ((mPostViewWidth*mPostViewHeight*3/2) + 16) * index;
-    unsigned int overlay_header[4];
+    unsigned int offset = ((job->postviewWidth*job->postviewHeight*3/2) + 16) * index;
 
-    // Only show postview image if size is VGA since sensor cannot deliver
-    // any other sizes.
-    int previewWidth, previewHeight, previewSize;
-    mSecCamera->getPreviewSize(&previewWidth, &previewHeight, &previewSize);
-    if ((previewWidth != 640) || (previewHeight != 480))
-        goto PostviewOverlayEnd;
+    mPreviewLock.lock();
+    if (!mPreviewRunning && mUseOverlay && mPreviewHeap != NULL) {
+        // Only show postview image if size is VGA since sensor cannot deliver
+        // any other sizes.
+        int previewWidth, previewHeight, previewSize;
+        mSecCamera->getPreviewSize(&previewWidth, &previewHeight, &previewSize);
+        if ((previewWidth == 640) && (previewHeight == 480))
+            overlay_frame = static_cast<uint8_t *>(mPreviewHeap->base()) + offset;
+    }
+#endif
 
-    mOverlayBufferIdx ^= 1;
-    overlay_header[0]= mSecCamera->getPhyAddrY(index);
-    overlay_header[1]= overlay_header[0] + mPostViewWidth*mPostViewHeight;
-    overlay_header[2]= mOverlayBufferIdx;
+    /* thumbnail, raw copy and overlay frame in one pass over the postview */
+    yuyvPostview((uint8_t *)job->postviewHeap->base(), job->postviewWidth, job->postviewHeight,
+                 (uint8_t *)mRawHeap->base(), overlay_frame,
+                 (uint8_t *)job->thumbnailHeap->base(), job->thumbWidth, job->thumbHeight);
 
-    YUY2toNV21(mRawHeap->base(), (void*)(static_cast<unsigned char *>(mPreviewHeap->base()) + offset),
-                mPostViewWidth, mPostViewHeight);
+#if defined(BOARD_USES_OVERLAY)
+    if (overlay_frame != NULL) {
+        unsigned int overlay_header[4];
+        int ret;
 
-    memcpy(static_cast<unsigned char*>(mPreviewHeap->base()) + offset + (mPostViewWidth*mPostViewHeight * 3 / 2),
-            overlay_header, 16);
+        mOverlayBufferIdx ^= 1;
+        overlay_header[0]= mSecCamera->getPhyAddrY(index);
+        overlay_header[1]= overlay_header[0] + job->postviewWidth*job->postviewHeight;
+        overlay_header[2]= mOverlayBufferIdx;
 
-    ret = mOverlay->queueBuffer((void*)(static_cast<unsigned char *>(mPreviewHeap->base()) + offset +
-                                (mPostViewWidth*mPostViewHeight * 3 / 2)));
+        memcpy(overlay_frame + (job->postviewWidth*job->postviewHeight * 3 / 2),
+                overlay_header, 16);
+
+        ret = mOverlay->queueBuffer((void*)(overlay_frame + (job->postviewWidth*job->postviewHeight * 3 / 2)));
 
-    if (ret == -1) {
-        LOGE("ERR(%s):overlay queueBuffer fail", __func__);
-    } else if (ret != ALL_BUFFERS_FLUSHED) {
-        overlay_buffer_t overlay_buffer;
-        ret = mOverlay->dequeueBuffer(&overlay_buffer);
         if (ret == -1) {
-            LOGE("ERR(%s):overlay dequeueBuffer fail", __func__);
+            LOGE("ERR(%s):overlay queueBuffer fail", __func__);
+        } else if (ret != ALL_BUFFERS_FLUSHED) {
+            overlay_buffer_t overlay_buffer;
+            ret = mOverlay->dequeueBuffer(&overlay_buffer);
+            if (ret == -1) {
+                LOGE("ERR(%s):overlay dequeueBuffer fail", __func__);
+            }
         }
     }
-
-PostviewOverlayEnd:
+    mPreviewLock.unlock();
 #endif
-    if (mMsgEnabled & CAMERA_MSG_RAW_IMAGE) {
+    if (job->msgs & CAMERA_MSG_RAW_IMAGE) {
         mDataCb(CAMERA_MSG_RAW_IMAGE, buffer, mCallbackCookie);
     }
-    if (mMsgEnabled & CAMERA_MSG_COMPRESSED_IMAGE) {
-        sp<MemoryHeapBase> ExifHeap = new MemoryHeapBase(EXIF_FILE_SIZE + JPG_STREAM_BUF_SIZE);
-        JpegExifSize = mSecCamera->getExif((unsigned char *)ExifHeap->base(),
-                (unsigned char *)ThumbnailHeap->base());
+
+    LOG_TIME_END(0)
+    LOG_CAMERA("postview stage interval: %lu us", LOG_TIME(0));
+    mTrace.record(CameraTrace::POSTVIEW_STAGE, stage_start);
+
+    mJpegStage->queueJob(job);
+    return NO_ERROR;
+}
+
+/* jpeg stage: wrap the stream in its EXIF header and deliver it */
+int CameraHardwareSec::jpegStage(CaptureJob *job)
+{
+    LOGV("%s :", __func__);
+
+    int ret = NO_ERROR;
+
+    nsecs_t stage_start = CameraTrace::now();
+    LOG_TIME_DEFINE(0)
+    LOG_TIME_START(0)
+
+    if (job->msgs & CAMERA_MSG_COMPRESSED_IMAGE) {
+        int JpegExifSize;
+
+        JpegExifSize = mSecCamera->getExif((unsigned char *)mExifHeap->base(),
+                (unsigned char *)job->thumbnailHeap->base(), &job->exif);
 
         LOGV("JpegExifSize=%d", JpegExifSize);
 
@@ -1101,34 +1601,282 @@ PostviewOverlayEnd:
             goto out;
         }
 
-        unsigned char *ExifStart = (unsigned char *)JpegHeap->base() + 2;
-        unsigned char *ImageStart = ExifStart + JpegExifSize;
+        if (JpegExifSize > kExifReserveSize) {
+            LOGE("ERR(%s):EXIF too large(%d)", __func__, JpegExifSize);
+            ret = UNKNOWN_ERROR;
+            goto out;
+        }
+
+        /* the image sits kExifReserveSize into the heap.  move its SOI
+         * marker down and write the EXIF between it and the rest of the
+         * image, so the image data itself is never moved.
+         */
+        unsigned char *ImageStart = (unsigned char *)job->jpegHeap->base() + kExifReserveSize;
+        unsigned char *JpegStart = ImageStart - JpegExifSize;
 
-        memmove(ImageStart, ExifStart, JpegImageSize - 2);
-        memcpy(ExifStart, ExifHeap->base(), JpegExifSize);
-        sp<MemoryBase> mem = new MemoryBase(JpegHeap, 0, JpegImageSize + JpegExifSize);
+        memcpy(JpegStart, ImageStart, 2);
+        memcpy(JpegStart + 2, mExifHeap->base(), JpegExifSize);
+        sp<MemoryBase> mem = new MemoryBase(job->jpegHeap, kExifReserveSize - JpegExifSize,
+                                            job->jpegImageSize + JpegExifSize);
 
+        mTrace.record(job->zsl ? CameraTrace::ZSL_SHUTTER_TO_JPEG : CameraTrace::SHUTTER_TO_JPEG,
+                      job->shutterTime);
         mDataCb(CAMERA_MSG_COMPRESSED_IMAGE, mem, mCallbackCookie);
     }
 
     LOG_TIME_END(0)
-    LOG_CAMERA("pictureThread interval: %lu us", LOG_TIME(0));
+    LOG_CAMERA("jpeg stage interval: %lu us", LOG_TIME(0));
+    mTrace.record(CameraTrace::JPEG_STAGE, stage_start);
 
     LOGV("%s : pictureThread end", __func__);
 
 out:
-    mStateLock.lock();
-    mCaptureInProgress = false;
-    mStateLock.unlock();
-
+    releaseCaptureJob(job);
     return ret;
 }
 
+void CameraHardwareSec::releaseCaptureJob(CaptureJob *job)
+{
+    if (job->bufferIndex >= 0) {
+        Mutex::Autolock lock(mCaptureBufferLock);
+        CaptureBuffer *cb = &mCaptureBuffers[job->bufferIndex];
+
+        /* drop the job's references first so only the pool and whoever
+         * got the jpeg still hold the heap
+         */
+        job->jpegHeap.clear();
+        job->postviewHeap.clear();
+        job->thumbnailHeap.clear();
+        cb->busy = false;
+        /* the shot size changed while this buffer was out */
+        if (cb->stale) {
+            cb->jpegHeap.clear();
+            cb->postviewHeap.clear();
+            cb->thumbnailHeap.clear();
+            cb->stale = false;
+        }
+        mCaptureBufferCondition.signal();
+    }
+    delete job;
+    putCaptureRef();
+}
+
+void CameraHardwareSec::putCaptureRef(void)
+{
+    Mutex::Autolock lock(mStateLock);
+    /* the last shot is out, the service's own mask applies again */
+    if (--mCaptureRefs == 0)
+        mCaptureMsgs = 0;
+}
+
+void CameraHardwareSec::getCaptureBufferSizes(int *jpegSize, int *postviewSize,
+                                              int *thumbSize)
+{
+    int width, height, frame_size;
+
+    mSecCamera->getSnapshotSize(&width, &height, &frame_size);
+    if (mSecCamera->getCameraId() == SecCamera::CAMERA_ID_BACK)
+        *jpegSize = frame_size * SecCamera::getJpegRatio();
+    else
+        *jpegSize = frame_size;
+    *jpegSize += kExifReserveSize;
+
+    mSecCamera->getPostViewConfig(&width, &height, postviewSize);
+    mSecCamera->getThumbnailConfig(&width, &height, thumbSize);
+}
+
+/* must be called with mCaptureBufferLock held */
+int CameraHardwareSec::allocCaptureBuffer_l(int index)
+{
+    CaptureBuffer *cb = &mCaptureBuffers[index];
+
+    LOG_TIME_DEFINE(0)
+    LOG_TIME_START(0)
+
+    cb->jpegHeap = new MemoryHeapBase(mCaptureBufferJpegSize);
+    cb->postviewHeap = new MemoryHeapBase(mCaptureBufferPostviewSize);
+    cb->thumbnailHeap = new MemoryHeapBase(mCaptureBufferThumbSize);
+    if (cb->jpegHeap->getHeapID() < 0 ||
+        cb->postviewHeap->getHeapID() < 0 ||
+        cb->thumbnailHeap->getHeapID() < 0) {
+        LOGE("ERR(%s):capture buffer %d allocation fail", __func__, index);
+        cb->jpegHeap.clear();
+        cb->postviewHeap.clear();
+        cb->thumbnailHeap.clear();
+        return -1;
+    }
+
+    LOG_TIME_END(0)
+    LOG_CAMERA("capture buffer %d allocation: %lu us", index, LOG_TIME(0));
+
+    return 0;
+}
+
+/* resize the capture buffer pool.  called whenever the picture size is
+ * set; idle buffers of the old size are dropped right away and buffers
+ * still out in the pipeline when they come back.  the first buffer is
+ * allocated up front so a single shot never has to.
+ */
+int CameraHardwareSec::allocCaptureBuffers(int jpegSize, int postviewSize, int thumbSize)
+{
+    Mutex::Autolock lock(mCaptureBufferLock);
+
+    if (jpegSize == mCaptureBufferJpegSize &&
+        postviewSize == mCaptureBufferPostviewSize &&
+        thumbSize == mCaptureBufferThumbSize)
+        return 0;
+
+    LOGV("%s : jpeg %d postview %d thumbnail %d", __func__,
+         jpegSize, postviewSize, thumbSize);
+
+    mCaptureBufferJpegSize = jpegSize;
+    mCaptureBufferPostviewSize = postviewSize;
+    mCaptureBufferThumbSize = thumbSize;
+
+    for (int i = 0; i < kCaptureBufferCount; i++) {
+        if (mCaptureBuffers[i].busy) {
+            mCaptureBuffers[i].stale = true;
+        } else {
+            mCaptureBuffers[i].jpegHeap.clear();
+            mCaptureBuffers[i].postviewHeap.clear();
+            mCaptureBuffers[i].thumbnailHeap.clear();
+        }
+    }
+
+    for (int i = 0; i < kCaptureBufferCount; i++) {
+        if (!mCaptureBuffers[i].busy)
+            return allocCaptureBuffer_l(i);
+    }
+
+    return 0;
+}
+
+/* block until a capture buffer is free and lend it to the job.  buffers
+ * are only allocated when every allocated one is out, so single shots
+ * keep reusing the same one and only bursts grow the pool.  a buffer
+ * whose jpeg is still referenced outside the pool is reallocated rather
+ * than overwritten.
+ */
+int CameraHardwareSec::getCaptureBuffer(CaptureJob *job)
+{
+    Mutex::Autolock lock(mCaptureBufferLock);
+    int index;
+
+    for (;;) {
+        index = -1;
+        for (int i = 0; i < kCaptureBufferCount; i++) {
+            if (mCaptureBuffers[i].busy)
+                continue;
+            if (mCaptureBuffers[i].jpegHeap != NULL &&
+                !isCaptureBufferHeld_l(i)) {
+                index = i;
+                break;
+            }
+            if (index < 0)
+                index = i;
+        }
+        if (index >= 0)
+            break;
+        mCaptureBufferCondition.wait(mCaptureBufferLock);
+    }
+
+    /* the jpeg callback hands the client a MemoryBase on jpegHeap, which
+     * it may still be reading.  leave the old heap to it and start over.
+     */
+    if (mCaptureBuffers[index].jpegHeap != NULL &&
+        isCaptureBufferHeld_l(index)) {
+        LOGV("%s : capture buffer %d still held by the client", __func__, index);
+        mCaptureBuffers[index].jpegHeap.clear();
+        mCaptureBuffers[index].postviewHeap.clear();
+        mCaptureBuffers[index].thumbnailHeap.clear();
+    }
+
+    if (mCaptureBuffers[index].jpegHeap == NULL &&
+        allocCaptureBuffer_l(index) < 0)
+        return -1;
+
+    mCaptureBuffers[index].busy = true;
+    job->jpegHeap = mCaptureBuffers[index].jpegHeap;
+    job->postviewHeap = mCaptureBuffers[index].postviewHeap;
+    job->thumbnailHeap = mCaptureBuffers[index].thumbnailHeap;
+    job->bufferIndex = index;
+
+    return 0;
+}
+
+/* true if anyone but the pool still holds the buffer's jpeg */
+bool CameraHardwareSec::isCaptureBufferHeld_l(int index)
+{
+    return mCaptureBuffers[index].jpegHeap->getStrongCount() > 1;
+}
+
+bool CameraHardwareSec::CaptureStage::threadLoop()
+{
+    CaptureJob *job;
+
+    mLock.lock();
+    while (mCount == 0 && !mExit)
+        mJobCondition.wait(mLock);
+    if (mCount == 0) {
+        /* queue drained, let stop() go on */
+        mDrained = true;
+        mDrainedCondition.signal();
+        mLock.unlock();
+        return false;
+    }
+    job = mJobs[mHead];
+    mHead = (mHead + 1) % kCaptureQueueDepth;
+    mCount--;
+    mSpaceCondition.signal();
+    mLock.unlock();
+
+    if ((mHardware->*mProcess)(job) != NO_ERROR)
+        LOGE("ERR(%s):%s failed", __func__, mName);
+
+    return true;
+}
+
+void CameraHardwareSec::CaptureStage::queueJob(CaptureJob *job)
+{
+    Mutex::Autolock lock(mLock);
+    while (mCount == kCaptureQueueDepth)
+        mSpaceCondition.wait(mLock);
+    mJobs[(mHead + mCount) % kCaptureQueueDepth] = job;
+    mCount++;
+    mJobCondition.signal();
+}
+
+void CameraHardwareSec::CaptureStage::stop()
+{
+    /* the thread stops calling threadLoop() once an exit is requested, so
+     * let it run the queue empty first
+     */
+    mLock.lock();
+    mExit = true;
+    mJobCondition.signal();
+    while (!mDrained)
+        mDrainedCondition.wait(mLock);
+    mLock.unlock();
+    requestExitAndWait();
+}
+
 status_t CameraHardwareSec::takePicture()
 {
     LOGV("%s :", __func__);
 
-    stopPreview();
+    return startCapture(mBurstCount);
+}
+
+status_t CameraHardwareSec::startCapture(int shots)
+{
+    LOGV("%s : shots = %d", __func__, shots);
+
+    nsecs_t shutter = systemTime(SYSTEM_TIME_MONOTONIC);
+
+    /* with a zsl ring the preview keeps running */
+    bool zsl = armZslFrames();
+    if (!zsl)
+        stopPreview();
 
     Mutex::Autolock lock(mStateLock);
     if (mCaptureInProgress) {
@@ -1136,11 +1884,20 @@ status_t CameraHardwareSec::takePicture()
         return INVALID_OPERATION;
     }
 
+    mShutterTime = shutter;
+    mZslCapture = zsl;
+    mCaptureShots = shots;
+    mBurstStop = false;
+    mCaptureMsgs = mMsgEnabled & (CAMERA_MSG_SHUTTER | CAMERA_MSG_RAW_IMAGE |
+                                  CAMERA_MSG_COMPRESSED_IMAGE);
+
     if (mPictureThread->run("CameraPictureThread", PRIORITY_DEFAULT) != NO_ERROR) {
         LOGE("%s : couldn't run picture thread", __func__);
+        mCaptureMsgs = 0;
         return INVALID_OPERATION;
     }
     mCaptureInProgress = true;
+    mCaptureRefs++;
 
     return NO_ERROR;
 }
@@ -1180,6 +1937,34 @@ bool CameraHardwareSec::CheckEOIMarker(unsigned char *pBuf)
     return false;
 }
 
+/* true if any byte of the word is 0xFF */
+#define HAS_MARKER_BYTE(w) \
+    (((~(w)) - 0x01010101) & (w) & 0x80808080)
+
+/* first 0xFF byte in [pBuf, pBufEnd), or NULL.  JPEG entropy data and
+ * YUV lines are mostly free of 0xFF, so test a word at a time and only
+ * look at single bytes around a hit.
+ */
+static unsigned char *findMarkerByte(unsigned char *pBuf, unsigned char *pBufEnd)
+{
+    while (pBuf < pBufEnd && ((unsigned long)pBuf & 3)) {
+        if (*pBuf == 0xFF)
+            return pBuf;
+        pBuf++;
+    }
+
+    while (pBuf + 4 <= pBufEnd && !HAS_MARKER_BYTE(*(unsigned int *)pBuf))
+        pBuf += 4;
+
+    while (pBuf < pBufEnd) {
+        if (*pBuf == 0xFF)
+            return pBuf;
+        pBuf++;
+    }
+
+    return NULL;
+}
+
 bool CameraHardwareSec::FindEOIMarkerInJPEG(unsigned char *pBuf, int dwBufSize, int *pnJPEGsize)
 {
     if (NULL == pBuf || 0 >= dwBufSize) {
@@ -1188,14 +1973,17 @@ bool CameraHardwareSec::FindEOIMarkerInJPEG(unsigned char *pBuf, int dwBufSize,
     }
 
     unsigned char *pBufEnd = pBuf + dwBufSize;
+    unsigned char *p = pBuf;
 
-    while (pBuf < pBufEnd) {
-        if (CheckEOIMarker(pBuf++))
+    while ((p = findMarkerByte(p, pBufEnd)) != NULL) {
+        if (CheckEOIMarker(p)) {
+            *pnJPEGsize += p - pBuf;
             return true;
-
-        (*pnJPEGsize)++;
+        }
+        p++;
     }
 
+    *pnJPEGsize += dwBufSize;
     return false;
 }
 
@@ -1293,6 +2081,18 @@ bool CameraHardwareSec::SplitFrame(unsigned char *pFrame, int dwSize,
     return bRet;
 }
 
+static inline bool isInterleavePadding(unsigned int word)
+{
+    return word == 0xFFFFFFFF || word == 0x02FFFFFF || word == 0xFF02FFFF;
+}
+
+/* padding or start-code of a YUV line */
+static inline bool isInterleaveCode(unsigned int word)
+{
+    return HAS_MARKER_BYTE(word) &&
+           (isInterleavePadding(word) || (word & 0xFFFF) == 0x05FF);
+}
+
 int CameraHardwareSec::decodeInterleaveData(unsigned char *pInterleaveData,
                                                  int interleaveDataSize,
                                                  int yuvWidth,
@@ -1316,8 +2116,7 @@ int CameraHardwareSec::decodeInterleaveData(unsigned char *pInterleaveData,
 
     LOGV("decodeInterleaveData Start~~~");
     while (i < interleaveDataSize) {
-        if ((*interleave_ptr == 0xFFFFFFFF) || (*interleave_ptr == 0x02FFFFFF) ||
-                (*interleave_ptr == 0xFF02FFFF)) {
+        if (isInterleavePadding(*interleave_ptr)) {
             // Padding Data
 //            LOGE("%d(%x) padding data\n", i, *interleave_ptr);
             interleave_ptr++;
@@ -1348,15 +2147,21 @@ int CameraHardwareSec::decodeInterleaveData(unsigned char *pInterleaveData,
                 break;
             }
         } else {
-            // Extract JPEG Data
+            // Extract JPEG Data, up to the next padding or YUV start-code.
+            // Both contain 0xFF, so most words are passed by a single test.
 //            LOGE("%d(%x) jpg data, jpeg_size = %d bytes\n", i, *interleave_ptr, jpeg_size);
+            unsigned int *run = interleave_ptr;
+            do {
+                interleave_ptr++;
+                i += 4;
+            } while (i < interleaveDataSize && !isInterleaveCode(*interleave_ptr));
+
             if (pJpegData != NULL) {
-                memcpy(jpeg_ptr, interleave_ptr, 4);
-                jpeg_ptr += 4;
-                jpeg_size += 4;
+                int run_size = (interleave_ptr - run) * 4;
+                memcpy(jpeg_ptr, run, run_size);
+                jpeg_ptr += run_size;
+                jpeg_size += run_size;
             }
-            interleave_ptr++;
-            i += 4;
         }
     }
     if (ret) {
@@ -1394,6 +2199,13 @@ status_t CameraHardwareSec::dump(int fd, const Vector<String16>& args) const
         mInternalParameters.dump(fd, args);
         snprintf(buffer, 255, " preview running(%s)\n", mPreviewRunning?"true": "false");
         result.append(buffer);
+        snprintf(buffer, 255, " preview callback 1 of %d frames, %lld us, overlay %lld us\n",
+                 mCallbackDivider, mCallbackCost / 1000, mOverlayCost / 1000);
+        result.append(buffer);
+        snprintf(buffer, 255, " record running(%s), frames in flight(%d/%d)\n",
+                 mRecordRunning?"true": "false", mRecordFramesInFlight, kBufferCountForRecord);
+        result.append(buffer);
+        mTrace.dump(result);
     } else {
         result.append("No camera client yet.\n");
     }
@@ -1497,7 +2309,11 @@ status_t CameraHardwareSec::setParameters(const CameraParameters& params)
                     __func__, new_picture_width, new_picture_height);
             ret = UNKNOWN_ERROR;
         } else {
+            int jpeg_heap_size, postview_size, thumb_size;
+
             mParameters.setPictureSize(new_picture_width, new_picture_height);
+            getCaptureBufferSizes(&jpeg_heap_size, &postview_size, &thumb_size);
+            allocCaptureBuffers(jpeg_heap_size, postview_size, thumb_size);
         }
     }
 
@@ -1549,6 +2365,52 @@ status_t CameraHardwareSec::setParameters(const CameraParameters& params)
         }
     }
 
+    // byte budget for encoded pictures, 0 to use the jpeg quality
+    int new_jpeg_target_size = params.getInt("jpeg-target-size");
+    LOGV("%s : new_jpeg_target_size %d", __func__, new_jpeg_target_size);
+    /* we ignore bad values */
+    if (0 <= new_jpeg_target_size) {
+        if (mSecCamera->setJpegTargetSize(new_jpeg_target_size) < 0) {
+            LOGE("ERR(%s):Fail on mSecCamera->setJpegTargetSize(size(%d))", __func__, new_jpeg_target_size);
+            ret = UNKNOWN_ERROR;
+        } else {
+            mParameters.set("jpeg-target-size", new_jpeg_target_size);
+        }
+    }
+
+    // burst capture: number of shots per takePicture()
+    int new_burst_count = params.getInt("burst-capture");
+    LOGV("%s : new_burst_count %d", __func__, new_burst_count);
+    /* we ignore bad values */
+    if (1 <= new_burst_count && new_burst_count <= kMaxBurstCount) {
+        mBurstCount = new_burst_count;
+        mParameters.set("burst-capture", new_burst_count);
+    }
+
+    // preview governor budget in ms, takes effect with the next startPreview()
+    int new_preview_budget = params.getInt("preview-latency-budget");
+    if (0 <= new_preview_budget) {
+        mPreviewBudgetMs = new_preview_budget;
+        mParameters.set("preview-latency-budget", new_preview_budget);
+    }
+
+    // zero shutter lag, takes effect with the next startPreview() and only
+    // while the preview, picture and postview sizes are equal
+    const char *new_zsl = params.get("zsl");
+    if (new_zsl != NULL) {
+        if (!strcmp(new_zsl, "on")) {
+            mZslEnabled = true;
+            mParameters.set("zsl", new_zsl);
+        } else if (!strcmp(new_zsl, "off")) {
+            mZslEnabled = false;
+            clearZslFrames();
+            mParameters.set("zsl", new_zsl);
+        } else {
+            LOGE("ERR(%s):Invalid zsl(%s)", __func__, new_zsl);
+            ret = UNKNOWN_ERROR;
+        }
+    }
+
     // JPEG thumbnail size
     int new_jpeg_thumbnail_width = params.getInt(CameraParameters::KEY_JPEG_THUMBNAIL_WIDTH);
     int new_jpeg_thumbnail_height= params.getInt(CameraParameters::KEY_JPEG_THUMBNAIL_HEIGHT);
@@ -2070,6 +2932,17 @@ CameraParameters CameraHardwareSec::getParameters() const
 
 status_t CameraHardwareSec::sendCommand(int32_t command, int32_t arg1, int32_t arg2)
 {
+    LOGV("%s : command = %d, arg1 = %d, arg2 = %d", __func__, command, arg1, arg2);
+
+    switch (command) {
+    case CAMERA_CMD_STOP_BURST_CAPTURE:
+        /* shots already captured still go through the pipeline */
+        mStateLock.lock();
+        mBurstStop = true;
+        mStateLock.unlock();
+        return NO_ERROR;
+    }
+
     return BAD_VALUE;
 }
 
@@ -2095,6 +2968,15 @@ void CameraHardwareSec::release()
         mPreviewThread->requestExitAndWait();
         mPreviewThread.clear();
     }
+    if (mRecordThread != NULL) {
+        mRecordLock.lock();
+        mRecordThread->requestExit();
+        mExitRecordThread = true;
+        mRecordCondition.signal();
+        mRecordLock.unlock();
+        mRecordThread->requestExitAndWait();
+        mRecordThread.clear();
+    }
     if (mAutoFocusThread != NULL) {
         /* this thread is normally already in it's threadLoop but blocked
          * on the condition variable.  signal it so it wakes up and can exit.
@@ -2111,12 +2993,37 @@ void CameraHardwareSec::release()
         mPictureThread->requestExitAndWait();
         mPictureThread.clear();
     }
+    /* stages drain their queues before exiting; the postview stage
+     * feeds the jpeg stage so it has to go first.
+     */
+    if (mPostviewStage != NULL) {
+        mPostviewStage->stop();
+        mPostviewStage.clear();
+    }
+    if (mJpegStage != NULL) {
+        mJpegStage->stop();
+        mJpegStage.clear();
+    }
+    /* no more encodes until the camera is opened again */
+    JpegService::getInstance()->shutdown();
+
     if (mRawHeap != NULL)
         mRawHeap.clear();
 
     if (mJpegHeap != NULL)
         mJpegHeap.clear();
 
+    if (mExifHeap != NULL)
+        mExifHeap.clear();
+
+    for (int i = 0; i < kCaptureBufferCount; i++) {
+        mCaptureBuffers[i].jpegHeap.clear();
+        mCaptureBuffers[i].postviewHeap.clear();
+        mCaptureBuffers[i].thumbnailHeap.clear();
+    }
+
+    clearZslFrames();
+
     if (mPreviewHeap != NULL) {
         LOGI("%s: calling mPreviewHeap.dispose()", __func__);
         mPreviewHeap->dispose();
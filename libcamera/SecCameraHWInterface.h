@@ -20,6 +20,7 @@
 #define ANDROID_HARDWARE_CAMERA_HARDWARE_SEC_H
 
 #include "SecCamera.h"
+#include "CameraTrace.h"
 #include <utils/threads.h>
 #include <camera/CameraHardwareInterface.h>
 #include <binder/MemoryBase.h>
@@ -27,6 +28,12 @@
 #include <utils/threads.h>
 
 namespace android {
+
+/* vendor sendCommand() extension, kept clear of the framework's ids.
+ * bursts are started by takePicture() with the burst-capture parameter.
+ */
+#define CAMERA_CMD_STOP_BURST_CAPTURE   0x1001
+
 class CameraHardwareSec : public CameraHardwareInterface {
 public:
     virtual sp<IMemoryHeap> getPreviewHeap() const;
@@ -91,6 +98,21 @@ private:
         }
     };
 
+    class RecordThread : public Thread {
+        CameraHardwareSec *mHardware;
+    public:
+        RecordThread(CameraHardwareSec *hw):
+        Thread(false),
+        mHardware(hw) { }
+        virtual void onFirstRef() {
+            run("CameraRecordThread", PRIORITY_URGENT_DISPLAY);
+        }
+        virtual bool threadLoop() {
+            mHardware->recordThreadWrapper();
+            return false;
+        }
+    };
+
     class PictureThread : public Thread {
         CameraHardwareSec *mHardware;
     public:
@@ -99,11 +121,89 @@ private:
         mHardware(hw) { }
         virtual bool threadLoop() {
             mHardware->pictureThread();
-            mHardware->mSecCamera->endSnapshot();
             return false;
         }
     };
 
+    /* one still moving through the capture pipeline */
+    struct CaptureJob {
+        sp<MemoryHeapBase>  jpegHeap;
+        sp<MemoryHeapBase>  postviewHeap;
+        sp<MemoryHeapBase>  thumbnailHeap;
+        int                 bufferIndex;    /* slot in mCaptureBuffers or -1 */
+        int                 jpegImageSize;
+        int                 postviewWidth;
+        int                 postviewHeight;
+        int                 postviewSize;
+        int                 thumbWidth;
+        int                 thumbHeight;
+        nsecs_t             shutterTime;
+        bool                zsl;            /* taken from the zsl ring */
+        int32_t             msgs;           /* mCaptureMsgs of its capture */
+        exif_attribute_t    exif;           /* as of when the shot was taken */
+    };
+
+    static  const int   kCaptureQueueDepth = 2;
+    static  const int   kCaptureBufferCount = 4;
+    static  const int   kMaxBurstCount = 10;
+    /* room left in front of the JPEG in jpegHeap for the EXIF APP1
+     * segment, which can't be larger than 64KB.  page sized so the
+     * JPEG itself stays aligned.
+     */
+    static  const int   kExifReserveSize = 17 * 4096;
+    /* most preview frames the governor may skip per callback */
+    static  const int   kMaxCallbackDivider = 4;
+    /* preview frames kept for zero shutter lag capture */
+    static  const int   kZslHistoryDepth = 3;
+
+    /* output heaps for one shot, kept across shots and only replaced
+     * when the picture size changes
+     */
+    struct CaptureBuffer {
+        sp<MemoryHeapBase>  jpegHeap;
+        sp<MemoryHeapBase>  postviewHeap;
+        sp<MemoryHeapBase>  thumbnailHeap;
+        bool                busy;
+        bool                stale;  /* free when it comes back */
+    };
+
+    /* a pipeline stage: a worker thread fed through a bounded queue.
+     * queueJob() blocks while the queue is full, so a slow stage
+     * throttles the stages in front of it.
+     */
+    class CaptureStage : public Thread {
+        CameraHardwareSec *mHardware;
+        int         (CameraHardwareSec::*mProcess)(CaptureJob *job);
+        const char  *mName;
+        Mutex       mLock;
+        Condition   mJobCondition;
+        Condition   mSpaceCondition;
+        Condition   mDrainedCondition;
+        CaptureJob  *mJobs[kCaptureQueueDepth];
+        int         mHead;
+        int         mCount;
+        bool        mExit;
+        bool        mDrained;
+    public:
+        CaptureStage(CameraHardwareSec *hw,
+                     int (CameraHardwareSec::*process)(CaptureJob *job),
+                     const char *name):
+        Thread(false),
+        mHardware(hw),
+        mProcess(process),
+        mName(name),
+        mHead(0),
+        mCount(0),
+        mExit(false),
+        mDrained(false) { }
+        virtual void onFirstRef() {
+            run(mName, PRIORITY_DEFAULT);
+        }
+        virtual bool threadLoop();
+                void queueJob(CaptureJob *job);
+                void stop();
+    };
+
     class AutoFocusThread : public Thread {
         CameraHardwareSec *mHardware;
     public:
@@ -124,12 +224,75 @@ private:
             int         previewThread();
             int         previewThreadWrapper();
 
+    sp<RecordThread>    mRecordThread;
+            int         recordThread();
+            int         recordThreadWrapper();
+
     sp<AutoFocusThread> mAutoFocusThread;
             int         autoFocusThread();
 
     sp<PictureThread>   mPictureThread;
             int         pictureThread();
+            int         captureShot(nsecs_t shutterTime);
+            status_t    startCapture(int shots);
             bool        mCaptureInProgress;
+            nsecs_t     mShutterTime;
+            int         mBurstCount;
+            int         mCaptureShots;
+            bool        mBurstStop;
+    /* the service clears CAMERA_MSG_COMPRESSED_IMAGE after each picture,
+     * so a capture keeps the capture messages enabled at takePicture()
+     * time until its last shot is delivered.  mCaptureRefs counts the
+     * picture thread and the shots still in the pipeline.
+     */
+            int32_t     mCaptureMsgs;
+            int         mCaptureRefs;
+            void        putCaptureRef(void);
+
+    sp<CaptureStage>    mPostviewStage;
+            int         postviewStage(CaptureJob *job);
+    sp<CaptureStage>    mJpegStage;
+            int         jpegStage(CaptureJob *job);
+            void        releaseCaptureJob(CaptureJob *job);
+
+            void        getCaptureBufferSizes(int *jpegSize, int *postviewSize,
+                                              int *thumbSize);
+            int         allocCaptureBuffers(int jpegSize, int postviewSize,
+                                            int thumbSize);
+            int         allocCaptureBuffer_l(int index);
+            int         getCaptureBuffer(CaptureJob *job);
+            bool        isCaptureBufferHeld_l(int index);
+    mutable Mutex       mCaptureBufferLock;
+    mutable Condition   mCaptureBufferCondition;
+            CaptureBuffer mCaptureBuffers[kCaptureBufferCount];
+            int         mCaptureBufferJpegSize;
+            int         mCaptureBufferPostviewSize;
+            int         mCaptureBufferThumbSize;
+
+    /* zero shutter lag: while the preview runs at the picture size and
+     * the postview size, takePicture() encodes a preview frame instead of
+     * restarting the sensor for a snapshot.  frames are only copied into
+     * the ring of kZslHistoryDepth while it is armed, from autoFocus() or
+     * takePicture() until the capture is done or focus is cancelled.
+     */
+            int         zslShot(nsecs_t shutterTime);
+            bool        isZslCapable(void);
+            void        allocZslFrames(int frameSize);
+            void        storeZslFrame(const void *frame, int size, nsecs_t time);
+            bool        armZslFrames(void);
+            void        disarmZslFrames(void);
+            int         findZslFrame_l(nsecs_t time);
+            void        clearZslFrames(void);
+    mutable Mutex       mZslLock;
+    mutable Condition   mZslCondition;
+    sp<MemoryHeapBase>  mZslHeap;
+            nsecs_t     mZslTime[kZslHistoryDepth];    /* 0 if empty */
+            int         mZslNext;
+            int         mZslFrameSize;
+            nsecs_t     mZslLastUsed;   /* newest frame already taken */
+            bool        mZslEnabled;
+            bool        mZslArmed;
+            bool        mZslCapture;    /* current capture uses the ring */
 
             int         save_jpeg(unsigned char *real_jpeg, int jpeg_size);
             void        save_postview(const char *fname, uint8_t *buf,
@@ -141,10 +304,6 @@ private:
                                                 int *pJpegSize,
                                                 void *pJpegData,
                                                 void *pYuvData);
-            bool        YUY2toNV21(void *srcBuf, void *dstBuf, uint32_t srcWidth, uint32_t srcHeight);
-            bool        scaleDownYuv422(char *srcBuf, uint32_t srcWidth,
-                                        uint32_t srcHight, char *dstBuf,
-                                        uint32_t dstWidth, uint32_t dstHight);
 
             bool        CheckVideoStartMarker(unsigned char *pBuf);
             bool        CheckEOIMarker(unsigned char *pBuf);
@@ -156,6 +315,9 @@ private:
                                    int *pdwJPEGSize, void *pVideo,
                                    int *pdwVideoSize);
             void        setSkipFrame(int frame);
+            void        acquirePreviewFrame(int index);
+            void        releasePreviewFrame(int index);
+            void        flushPreviewFrames(void);
             bool        isSupportedPreviewSize(const int width,
                                                const int height) const;
     /* used by auto focus thread to block until it's told to run */
@@ -180,6 +342,7 @@ private:
     sp<MemoryHeapBase>  mRawHeap;
     sp<MemoryHeapBase>  mRecordHeap;
     sp<MemoryHeapBase>  mJpegHeap;
+    sp<MemoryHeapBase>  mExifHeap;
     sp<MemoryBase>      mBuffers[kBufferCount];
     sp<MemoryBase>      mRecordBuffers[kBufferCountForRecord];
 
@@ -189,10 +352,34 @@ private:
     mutable Mutex       mSkipFrameLock;
             int         mSkipFrame;
 
+    /* number of consumers (preview thread, callback, overlay) still
+     * holding each dequeued preview buffer.  the buffer goes back to
+     * the driver when its count drops to zero.
+     */
+    mutable Mutex       mPreviewFrameLock;
+            int         mPreviewFrameRefs[kBufferCount];
+            nsecs_t     mPreviewFrameTime[kBufferCount];   /* dequeue time */
+
+    /* preview governor: the preview thread has mPreviewBudget per frame.
+     * when the preview callback doesn't fit next to the overlay it is
+     * only delivered every mCallbackDivider frames; the overlay still
+     * gets all of them.
+     */
+            void        updatePreviewGovernor(nsecs_t callbackCost);
+            nsecs_t     mPreviewBudget;
+            int         mPreviewBudgetMs;   /* 0: one frame interval */
+            nsecs_t     mCallbackCost;      /* moving averages */
+            nsecs_t     mOverlayCost;
+            int         mCallbackDivider;
+            int         mCallbackPhase;
+
+            CameraTrace mTrace;
+
 #if defined(BOARD_USES_OVERLAY)
             sp<Overlay> mOverlay;
             bool        mUseOverlay;
             int         mOverlayBufferIdx;
+            int         mOverlayFrameIdx;
 #endif
 
     notify_callback     mNotifyCb;
@@ -202,8 +389,14 @@ private:
 
             int32_t     mMsgEnabled;
 
+    /* used by record thread to block until it's told to run */
             bool        mRecordRunning;
+            bool        mExitRecordThread;
     mutable Mutex       mRecordLock;
+    mutable Condition   mRecordCondition;
+    mutable Condition   mRecordStoppedCondition;
+    /* record frames handed to the encoder and not yet released */
+    volatile int32_t    mRecordFramesInFlight;
             int         mPostViewWidth;
             int         mPostViewHeight;
             int         mPostViewSize;
@@ -22,7 +22,10 @@ LOCAL_C_INCLUDES := $(LOCAL_PATH)
 LOCAL_C_INCLUDES += $(LOCAL_PATH)/../include
 
 LOCAL_SRC_FILES:= \
-	JpegEncoder.cpp
+	JpegEncoder.cpp \
+	JpegService.cpp \
+	SwJpegEncoder.cpp \
+	YuvConvert.cpp
 
 LOCAL_SHARED_LIBRARIES:= liblog
 LOCAL_SHARED_LIBRARIES+= libdl
@@ -26,35 +26,23 @@
 #include <utils/Log.h>
 #include <sys/mman.h>
 #include <fcntl.h>
+#include <math.h>
 
 #include "JpegEncoder.h"
+#include "SwJpegEncoder.h"
+#include "YuvConvert.h"
 
 static const char ExifAsciiPrefix[] = { 0x41, 0x53, 0x43, 0x49, 0x49, 0x0, 0x0, 0x0 };
 
 namespace android {
-JpegEncoder::JpegEncoder() : available(false)
+JpegEncoder::JpegEncoder() : mDevFd(-1), mExifOut(NULL), mExifLen(0), mSoftware(true),
+                             mTargetSize(0), mSwQuality(0), available(false)
 {
     mArgs.mmapped_addr = (char *)MAP_FAILED;
     mArgs.enc_param       = NULL;
     mArgs.thumb_enc_param = NULL;
-
-    mDevFd = open(JPG_DRIVER_NAME, O_RDWR);
-    if (mDevFd < 0) {
-        LOGE("Failed to open the device");
-        return;
-    }
-
-    mArgs.mmapped_addr = (char *)mmap(0,
-                                      JPG_TOTAL_BUF_SIZE,
-                                      PROT_READ | PROT_WRITE,
-                                      MAP_SHARED,
-                                      mDevFd,
-                                      0);
-
-    if (mArgs.mmapped_addr == MAP_FAILED) {
-        LOGE("Failed to mmap");
-        return;
-    }
+    memset(mSwBuf, 0, sizeof(mSwBuf));
+    memset(mSwBufSize, 0, sizeof(mSwBufSize));
 
     mArgs.enc_param = new jpg_enc_proc_param;
     if (mArgs.enc_param == NULL) {
@@ -81,15 +69,394 @@ JpegEncoder::JpegEncoder() : available(false)
 
 JpegEncoder::~JpegEncoder()
 {
-    if (mArgs.mmapped_addr != (char*)MAP_FAILED)
-        munmap(mArgs.mmapped_addr, JPG_TOTAL_BUF_SIZE);
+    closeHardware();
 
     delete mArgs.enc_param;
 
     delete mArgs.thumb_enc_param;
 
-    if (mDevFd > 0)
+    delete[] mExifOut;
+}
+
+/* maps the JPEG block for the next encode.  while it is missing, or busy
+ * with another client, encodes run in software and the block is tried
+ * again on the next call.
+ */
+int JpegEncoder::openHardware()
+{
+    if (mDevFd >= 0)
+        return 0;
+
+    mSoftware = true;
+
+    mDevFd = open(JPG_DRIVER_NAME, O_RDWR);
+    if (mDevFd < 0) {
+        LOGW("Failed to open the device, encoding in software");
+        return -1;
+    }
+
+    mArgs.mmapped_addr = (char *)mmap(0,
+                                      JPG_TOTAL_BUF_SIZE,
+                                      PROT_READ | PROT_WRITE,
+                                      MAP_SHARED,
+                                      mDevFd,
+                                      0);
+
+    if (mArgs.mmapped_addr == MAP_FAILED) {
+        LOGW("Failed to mmap, encoding in software");
+        close(mDevFd);
+        mDevFd = -1;
+        return -1;
+    }
+
+    mSoftware = false;
+    return 0;
+}
+
+/* gives the block back, and the heap buffers standing in for it, until
+ * the next openHardware()
+ */
+void JpegEncoder::closeHardware()
+{
+    if (mArgs.mmapped_addr != (char *)MAP_FAILED) {
+        munmap(mArgs.mmapped_addr, JPG_TOTAL_BUF_SIZE);
+        mArgs.mmapped_addr = (char *)MAP_FAILED;
+    }
+
+    if (mDevFd >= 0) {
         close(mDevFd);
+        mDevFd = -1;
+    }
+
+    for (int i = 0; i < 4; i++) {
+        delete[] mSwBuf[i];
+        mSwBuf[i] = NULL;
+        mSwBufSize[i] = 0;
+    }
+
+    mArgs.in_buf = NULL;
+    mArgs.out_buf = NULL;
+    mArgs.in_thumb_buf = NULL;
+    mArgs.out_thumb_buf = NULL;
+    mSoftware = true;
+}
+
+/* returns the buffer the driver hands out for request.  in software mode
+ * it is a heap buffer, grown to hold at least size bytes.
+ */
+char *JpegEncoder::getBuffer(int request, uint64_t size)
+{
+    if (!mSoftware)
+        return (char *)ioctl(mDevFd, request, mArgs.mmapped_addr);
+
+    int i;
+    switch (request) {
+    case IOCTL_JPG_GET_STRBUF:
+        i = 0;
+        break;
+    case IOCTL_JPG_GET_THUMB_STRBUF:
+        i = 1;
+        break;
+    case IOCTL_JPG_GET_FRMBUF:
+        i = 2;
+        break;
+    case IOCTL_JPG_GET_THUMB_FRMBUF:
+        i = 3;
+        break;
+    default:
+        return NULL;
+    }
+
+    if (size > mSwBufSize[i]) {
+        delete[] mSwBuf[i];
+        mSwBuf[i] = new char[size];
+        mSwBufSize[i] = mSwBuf[i] != NULL ? size : 0;
+    }
+
+    return mSwBuf[i];
+}
+
+/* encodes the main or thumbnail frame buffer into its stream buffer.
+ * when the block turns the job down, or there is none, the frame is
+ * encoded on the CPU instead.
+ */
+jpg_return_status JpegEncoder::encodeImage(bool isThumb)
+{
+    jpg_enc_proc_param *param = isThumb ? mArgs.thumb_enc_param : mArgs.enc_param;
+    jpg_return_status ret;
+
+    if (!mSoftware) {
+        mArgs.enc_param->enc_type = isThumb ? JPG_THUMBNAIL : JPG_MAIN;
+        ret = (jpg_return_status)ioctl(mDevFd, IOCTL_JPG_ENCODE, &mArgs);
+        if (ret == JPG_SUCCESS)
+            return ret;
+        LOGW("JPEG block failed(%d), encoding in software", ret);
+    }
+
+    if (param->in_format != JPG_MODESEL_YCBCR) {
+        LOGE("Software encoding needs YCbCr input");
+        return JPG_FAIL;
+    }
+
+    /* frames for the block were padded to whole MCUs by checkMcu() */
+    uint32_t stride = param->width * 2;
+    uint32_t outSize;
+    if (!mSoftware) {
+        stride = ((param->width + 15) & ~15) * 2;
+        outSize = isThumb ? JPG_STREAM_THUMB_BUF_SIZE : JPG_STREAM_BUF_SIZE;
+    } else {
+        outSize = param->width * param->height * 2 + 4096;
+    }
+
+    char *in = isThumb ? mArgs.in_thumb_buf : mArgs.in_buf;
+    char *out = getBuffer(isThumb ? IOCTL_JPG_GET_THUMB_STRBUF : IOCTL_JPG_GET_STRBUF, outSize);
+    if (in == NULL || out == NULL) {
+        LOGE("No buffers for software encoding");
+        return JPG_FAIL;
+    }
+
+    int quality = swJpegQuality(param->quality);
+    if (!isThumb && mSwQuality > 0)
+        quality = mSwQuality;
+
+    uint32_t fileSize;
+    ret = swJpegEncode((const uint8_t *)in, param->width, param->height, stride,
+                       param->sample_mode, quality, (uint8_t *)out, outSize, &fileSize);
+    if (ret == JPG_SUCCESS)
+        param->file_size = fileSize;
+
+    return ret;
+}
+
+/* rate model of the target size mode, fitted on the software encoder
+ * over a set of photos, screenshots and synthetic images:
+ *
+ *   bytes per pixel = RATE_BASE + k * activity^RATE_EXP * scale^-RATE_EXP
+ *
+ * activity is yuyvActivity(), scale the IJG scaling of the quantization
+ * tables in percent.  k varies by about 16% (rms) from image to image,
+ * which the second pass makes up for by refitting it.
+ */
+#define RATE_BASE           0.01f
+#define RATE_EXP            0.55f
+#define RATE_K_422          0.28f
+#define RATE_K_420          0.25f
+
+/* the first pass aims below the target so that most images fit in one,
+ * the second closer to it.  a first pass using less than RATE_REFINE of
+ * the target is tried again at a higher quality.
+ */
+#define RATE_AIM_FIRST      0.9f
+#define RATE_AIM_SECOND     0.97f
+#define RATE_REFINE         0.75f
+
+#define MIN_TARGET_QUALITY  5
+#define MAX_TARGET_QUALITY  95
+
+/* the JPEG block codes its four levels with tables of its own, so the
+ * software fit doesn't hold for them.  each level starts at the scale of
+ * the software quality it maps to (90, 80, 70 and 60) and is moved by
+ * RATE_CAL_WEIGHT towards the scale every target size pass on the block
+ * measures.  only used from the JPEG service thread; kept across encoder
+ * instances so the calibration outlives a camera session.
+ */
+#define RATE_CAL_WEIGHT     0.25f
+
+static float sHwScale[JPG_QUALITY_LEVEL_4 + 1] = { 20, 40, 60, 80 };
+
+/* mean absolute luma gradient over every 4th pixel of every 4th line, a
+ * cheap measure of how much detail there is to code
+ */
+static float yuyvActivity(const uint8_t *src, uint32_t width, uint32_t height)
+{
+    uint32_t stride = width * 2;
+    uint32_t sum = 0;
+    uint32_t count = 0;
+
+    for (uint32_t y = 0; y + 1 < height; y += 4) {
+        const uint8_t *line = src + y * stride;
+        const uint8_t *next = line + stride;
+
+        for (uint32_t x = 0; x + 2 < stride; x += 8) {
+            sum += abs(line[x + 2] - line[x]) + abs(next[x] - line[x]);
+            count++;
+        }
+    }
+
+    return count > 0 ? (float)sum / count : 0;
+}
+
+static float jpegScale(int quality)
+{
+    return quality < 50 ? 5000.0f / quality : 200.0f - quality * 2;
+}
+
+/* the scale expected to code detail (k * activity^RATE_EXP) in bpp bytes
+ * per pixel
+ */
+static float rateScale(float k, float detail, float bpp)
+{
+    if (bpp <= RATE_BASE)
+        return jpegScale(MIN_TARGET_QUALITY);
+
+    return powf(k * detail / (bpp - RATE_BASE), 1 / RATE_EXP);
+}
+
+/* the block's level for a quality returned by qualityForScale() */
+static image_quality_type_t levelForQuality(int quality)
+{
+    int level = JPG_QUALITY_LEVEL_1;
+    while (level < JPG_QUALITY_LEVEL_4 &&
+           swJpegQuality((image_quality_type_t)level) > quality)
+        level++;
+    return (image_quality_type_t)level;
+}
+
+/* moves the scale of the level quality maps to towards the one a pass
+ * that coded detail in bpp bytes per pixel measured, keeping the levels
+ * in order
+ */
+static void calibrateHwScale(int quality, float k, float detail, float bpp)
+{
+    if (bpp <= RATE_BASE)
+        return;
+
+    image_quality_type_t level = levelForQuality(quality);
+    float measured = rateScale(k, detail, bpp);
+    float scale = sHwScale[level] + (measured - sHwScale[level]) * RATE_CAL_WEIGHT;
+
+    if (level > JPG_QUALITY_LEVEL_1 && scale <= sHwScale[level - 1])
+        scale = sHwScale[level - 1] + 1;
+    if (level < JPG_QUALITY_LEVEL_4 && scale >= sHwScale[level + 1])
+        scale = sHwScale[level + 1] - 1;
+    sHwScale[level] = scale;
+}
+
+/* the scale the main image is coded at for quality on the backend in use */
+float JpegEncoder::qualityScale(int quality) const
+{
+    if (!mSoftware)
+        return sHwScale[levelForQuality(quality)];
+
+    return jpegScale(quality);
+}
+
+/* returns the highest quality the encoder does whose scale isn't below
+ * scale, so that the file comes out no larger than the model says
+ */
+int JpegEncoder::qualityForScale(float scale) const
+{
+    if (!mSoftware) {
+        for (int level = JPG_QUALITY_LEVEL_1; level < JPG_QUALITY_LEVEL_4; level++) {
+            if (sHwScale[level] >= scale)
+                return swJpegQuality((image_quality_type_t)level);
+        }
+        return swJpegQuality(JPG_QUALITY_LEVEL_4);
+    }
+
+    int quality;
+    if (scale > 100)
+        quality = (int)(5000 / scale);
+    else
+        quality = (int)((200 - scale) / 2);
+
+    if (quality < MIN_TARGET_QUALITY)
+        quality = MIN_TARGET_QUALITY;
+    if (quality > MAX_TARGET_QUALITY)
+        quality = MAX_TARGET_QUALITY;
+
+    return quality;
+}
+
+/* sets a quality returned by qualityForScale() for the main image */
+void JpegEncoder::setQuality(int quality)
+{
+    if (mSoftware) {
+        mSwQuality = quality;
+        return;
+    }
+
+    mArgs.enc_param->quality = levelForQuality(quality);
+}
+
+/* encodes the main image at the quality expected to come closest to
+ * targetSize without going over, in at most two passes.  the first is
+ * placed by the rate model from the activity of the frame.  when it
+ * overshoots, or leaves much of the budget unused, its size refits the
+ * model to the image and a second pass is made.  a second pass that
+ * overshoots after an undershoot gives way to the first.  an image that
+ * doesn't fit even at the lowest quality is kept, with a warning.
+ */
+jpg_return_status JpegEncoder::encodeToSize(float activity, uint32_t targetSize)
+{
+    jpg_enc_proc_param *param = mArgs.enc_param;
+    image_quality_type_t level = param->quality;
+    float pixels = (float)param->width * param->height;
+    float fit = param->sample_mode == JPG_422 ? RATE_K_422 : RATE_K_420;
+    float k = fit;
+    float detail = powf(activity > 0.5f ? activity : 0.5f, RATE_EXP);
+    int passes = 1;
+
+    if (pixels == 0)
+        return JPG_FAIL;
+
+    int quality = qualityForScale(rateScale(k, detail, targetSize * RATE_AIM_FIRST / pixels));
+    setQuality(quality);
+
+    jpg_return_status ret = encodeImage(false);
+    uint32_t size = param->file_size;
+    bool over = size > targetSize;
+    if (ret == JPG_SUCCESS && !mSoftware)
+        calibrateHwScale(quality, fit, detail, size / pixels);
+
+    if (ret == JPG_SUCCESS && (over || size < targetSize * RATE_REFINE)) {
+        float bpp = size / pixels;
+        if (bpp > RATE_BASE)
+            k = (bpp - RATE_BASE) * powf(qualityScale(quality), RATE_EXP) / detail;
+
+        int retry = qualityForScale(rateScale(k, detail, targetSize * RATE_AIM_SECOND / pixels));
+        if (over) {
+            int lower = qualityForScale(qualityScale(quality) + 1);
+            if (retry > lower)
+                retry = lower;
+        }
+
+        if (over ? retry < quality : retry > quality) {
+            /* keep the first pass in case the second one doesn't fit */
+            char *first = NULL;
+            if (!over) {
+                first = new char[size];
+                if (first != NULL)
+                    memcpy(first, getBuffer(IOCTL_JPG_GET_STRBUF, 0), size);
+            }
+
+            setQuality(retry);
+            ret = encodeImage(false);
+            passes++;
+            if (ret == JPG_SUCCESS && !mSoftware)
+                calibrateHwScale(retry, fit, detail, param->file_size / pixels);
+
+            if (first != NULL && (ret != JPG_SUCCESS || param->file_size > targetSize)) {
+                memcpy(getBuffer(IOCTL_JPG_GET_STRBUF, 0), first, size);
+                param->file_size = size;
+                ret = JPG_SUCCESS;
+            } else {
+                quality = retry;
+            }
+            delete[] first;
+        }
+    }
+
+    if (ret == JPG_SUCCESS) {
+        if (param->file_size > targetSize)
+            LOGW("%u bytes over the target of %u", param->file_size - targetSize, targetSize);
+        LOGD("target %u bytes, made %u at quality %d in %d passes",
+             targetSize, param->file_size, quality, passes);
+    }
+
+    mSwQuality = 0;
+    param->quality = level;
+    return ret;
 }
 
 jpg_return_status JpegEncoder::setConfig(jpeg_conf type, int32_t value)
@@ -101,14 +468,14 @@ jpg_return_status JpegEncoder::setConfig(jpeg_conf type, int32_t value)
 
     switch (type) {
     case JPEG_SET_ENCODE_WIDTH:
-        if (value < 0 || value > MAX_JPG_WIDTH)
+        if (value < 0 || value > (mSoftware ? MAX_SW_JPG_WIDTH : MAX_JPG_WIDTH))
             ret = JPG_FAIL;
         else
             mArgs.enc_param->width = value;
         break;
 
     case JPEG_SET_ENCODE_HEIGHT:
-        if (value < 0 || value > MAX_JPG_HEIGHT)
+        if (value < 0 || value > (mSoftware ? MAX_SW_JPG_HEIGHT : MAX_JPG_HEIGHT))
             ret = JPG_FAIL;
         else
             mArgs.enc_param->height = value;
@@ -153,6 +520,13 @@ jpg_return_status JpegEncoder::setConfig(jpeg_conf type, int32_t value)
             mArgs.thumb_enc_param->height = value;
         break;
 
+    case JPEG_SET_ENCODE_TARGET_SIZE:
+        if (value < 0)
+            ret = JPG_FAIL;
+        else
+            mTargetSize = value;
+        break;
+
     default:
         LOGE("Invalid Config type");
         ret = ERR_UNKNOWN;
@@ -169,15 +543,15 @@ void* JpegEncoder::getInBuf(uint64_t size)
     if (!available)
         return NULL;
 
-    if (size > JPG_FRAME_BUF_SIZE) {
+    if (!mSoftware && size > JPG_FRAME_BUF_SIZE) {
         LOGE("The buffer size requested is too large");
         return NULL;
     }
-    mArgs.in_buf = (char *)ioctl(mDevFd, IOCTL_JPG_GET_FRMBUF, mArgs.mmapped_addr);
+    mArgs.in_buf = getBuffer(IOCTL_JPG_GET_FRMBUF, size);
     return (void *)(mArgs.in_buf);
 }
 
-void* JpegEncoder::getOutBuf(uint64_t *size)
+void* JpegEncoder::getStreamBuf(uint64_t *size)
 {
     if (!available)
         return NULL;
@@ -186,21 +560,47 @@ void* JpegEncoder::getOutBuf(uint64_t *size)
         LOGE("The buffer requested doesn't have data");
         return NULL;
     }
-    mArgs.out_buf = (char *)ioctl(mDevFd, IOCTL_JPG_GET_STRBUF, mArgs.mmapped_addr);
+    mArgs.out_buf = getBuffer(IOCTL_JPG_GET_STRBUF, 0);
     *size = mArgs.enc_param->file_size;
     return (void *)(mArgs.out_buf);
 }
 
+/* the stream buffer holds the bare image; the EXIF made by encode() is
+ * put behind its SOI marker while copying it out.
+ */
+jpg_return_status JpegEncoder::copyOutBuf(void *dst, unsigned int *size)
+{
+    if (!available)
+        return JPG_FAIL;
+
+    if (mArgs.enc_param->file_size <= 2) {
+        LOGE("The buffer requested doesn't have data");
+        return JPG_FAIL;
+    }
+    mArgs.out_buf = getBuffer(IOCTL_JPG_GET_STRBUF, 0);
+
+    unsigned char *out = (unsigned char *)dst;
+    unsigned int fileSize = mArgs.enc_param->file_size;
+
+    memcpy(out, mArgs.out_buf, 2);
+    if (mExifOut != NULL)
+        memcpy(out + 2, mExifOut, mExifLen);
+    memcpy(out + 2 + mExifLen, &mArgs.out_buf[2], fileSize - 2);
+
+    *size = fileSize + mExifLen;
+    return JPG_SUCCESS;
+}
+
 void* JpegEncoder::getThumbInBuf(uint64_t size)
 {
     if (!available)
         return NULL;
 
-    if (size > JPG_FRAME_THUMB_BUF_SIZE) {
+    if (!mSoftware && size > JPG_FRAME_THUMB_BUF_SIZE) {
         LOGE("The buffer size requested is too large");
         return NULL;
     }
-    mArgs.in_thumb_buf = (char *)ioctl(mDevFd, IOCTL_JPG_GET_THUMB_FRMBUF, mArgs.mmapped_addr);
+    mArgs.in_thumb_buf = getBuffer(IOCTL_JPG_GET_THUMB_FRMBUF, size);
     return (void *)(mArgs.in_thumb_buf);
 }
 
@@ -213,12 +613,13 @@ void* JpegEncoder::getThumbOutBuf(uint64_t *size)
         LOGE("The buffer requested doesn't have data");
         return NULL;
     }
-    mArgs.out_thumb_buf = (char *)ioctl(mDevFd, IOCTL_JPG_GET_THUMB_STRBUF, mArgs.mmapped_addr);
+    mArgs.out_thumb_buf = getBuffer(IOCTL_JPG_GET_THUMB_STRBUF, 0);
     *size = mArgs.thumb_enc_param->file_size;
     return (void *)(mArgs.out_thumb_buf);
 }
 
-jpg_return_status JpegEncoder::encode(unsigned int *size, exif_attribute_t *exifInfo)
+jpg_return_status JpegEncoder::encode(unsigned int *size, exif_attribute_t *exifInfo,
+                                      ExifTemplate *exifTemplate)
 {
     if (!available)
         return JPG_FAIL;
@@ -226,24 +627,38 @@ jpg_return_status JpegEncoder::encode(unsigned int *size, exif_attribute_t *exif
     LOGD("encode E");
 
     jpg_return_status ret = JPG_FAIL;
-    unsigned char *exifOut = NULL;
     jpg_enc_proc_param *param = mArgs.enc_param;
 
-    ret = checkMcu(param->sample_mode, param->width, param->height, false);
-    if (ret != JPG_SUCCESS)
-        return ret;
+    /* the target size only holds for this encode */
+    uint32_t targetSize = mTargetSize;
+    mTargetSize = 0;
+
+    delete[] mExifOut;
+    mExifOut = NULL;
+    mExifLen = 0;
+
+    /* measured before checkMcu() pads the frame */
+    float activity = 0;
+    if (targetSize > 0 && mArgs.in_buf != NULL)
+        activity = yuyvActivity((const uint8_t *)mArgs.in_buf, param->width, param->height);
 
-    param->enc_type = JPG_MAIN;
-    ret = (jpg_return_status)ioctl(mDevFd, IOCTL_JPG_ENCODE, &mArgs);
+    /* the software encoder pads the edges itself */
+    if (!mSoftware) {
+        ret = checkMcu(param->sample_mode, param->width, param->height, false);
+        if (ret != JPG_SUCCESS)
+            return ret;
+    }
+
+    ret = targetSize > 0 ? encodeToSize(activity, targetSize) : encodeImage(false);
     if (ret != JPG_SUCCESS) {
         LOGE("Failed to encode main image");
         return ret;
     }
 
-    mArgs.out_buf = (char *)ioctl(mDevFd, IOCTL_JPG_GET_STRBUF, mArgs.mmapped_addr);
+    mArgs.out_buf = getBuffer(IOCTL_JPG_GET_STRBUF, 0);
 
     if (exifInfo) {
-        unsigned int thumbLen, exifLen;
+        unsigned int thumbLen;
 
         uint_t bufSize = 0;
         if (exifInfo->enableThumb) {
@@ -259,31 +674,24 @@ jpg_return_status JpegEncoder::encode(unsigned int *size, exif_attribute_t *exif
             bufSize = EXIF_FILE_SIZE;
         }
 
-        if (mArgs.enc_param->file_size + bufSize > JPG_TOTAL_BUF_SIZE)
-            return ret;
-
-        exifOut = new unsigned char[bufSize];
-        if (exifOut == NULL) {
+        mExifOut = new unsigned char[bufSize];
+        if (mExifOut == NULL) {
             LOGE("Failed to allocate for exifOut");
             return ret;
         }
-        memset(exifOut, 0, bufSize);
+        memset(mExifOut, 0, bufSize);
 
-        ret = makeExif (exifOut, exifInfo, &exifLen);
+        ret = makeExif (mExifOut, exifInfo, &mExifLen, false, exifTemplate);
         if (ret != JPG_SUCCESS) {
             LOGE("Failed to make EXIF");
-            delete[] exifOut;
+            delete[] mExifOut;
+            mExifOut = NULL;
+            mExifLen = 0;
             return ret;
         }
-
-        memmove(&mArgs.out_buf[exifLen + 2], &mArgs.out_buf[2], param->file_size - 2);
-        memcpy(&mArgs.out_buf[2], exifOut, exifLen);
-        param->file_size += exifLen;
     }
 
-    delete[] exifOut;
-
-    *size = param->file_size;
+    *size = param->file_size + mExifLen;
 
 #if MAIN_DUMP
     FILE *fout = NULL;
@@ -317,28 +725,28 @@ jpg_return_status JpegEncoder::encodeThumbImg(unsigned int *size, bool useMain)
             return JPG_FAIL;
         }
 
-        ret = (jpg_return_status)scaleDownYuv422(mArgs.in_buf,
-                                                 mArgs.enc_param->width,
-                                                 mArgs.enc_param->height,
-                                                 mArgs.in_thumb_buf,
-                                                 param->width,
-                                                 param->height);
-        if (ret != JPG_SUCCESS)
+        if (!yuyvScaleDown((uint8_t *)mArgs.in_buf,
+                           mArgs.enc_param->width,
+                           mArgs.enc_param->height,
+                           (uint8_t *)mArgs.in_thumb_buf,
+                           param->width,
+                           param->height))
             return JPG_FAIL;
     }
 
-    ret = checkMcu(param->sample_mode, param->width, param->height, true);
-    if (ret != JPG_SUCCESS)
-        return JPG_FAIL;
+    if (!mSoftware) {
+        ret = checkMcu(param->sample_mode, param->width, param->height, true);
+        if (ret != JPG_SUCCESS)
+            return JPG_FAIL;
+    }
 
-    mArgs.enc_param->enc_type = JPG_THUMBNAIL;
-    ret = (jpg_return_status)ioctl(mDevFd, IOCTL_JPG_ENCODE, &mArgs);
+    ret = encodeImage(true);
     if (ret != JPG_SUCCESS) {
         LOGE("Failed to encode for thumbnail");
         return JPG_FAIL;
     }
 
-    mArgs.out_thumb_buf = (char *)ioctl(mDevFd, IOCTL_JPG_GET_THUMB_STRBUF, mArgs.mmapped_addr);
+    mArgs.out_thumb_buf = getBuffer(IOCTL_JPG_GET_THUMB_STRBUF, 0);
 
 #if THUMB_DUMP
     FILE *fout = NULL;
@@ -358,13 +766,33 @@ jpg_return_status JpegEncoder::encodeThumbImg(unsigned int *size, bool useMain)
 jpg_return_status JpegEncoder::makeExif (unsigned char *exifOut,
                                         exif_attribute_t *exifInfo,
                                         unsigned int *size,
-                                        bool useMainbufForThumb)
+                                        bool useMainbufForThumb,
+                                        ExifTemplate *exifTemplate)
 {
     if (!available)
         return JPG_FAIL;
 
     LOGD("makeExif E");
 
+    char *thumbBuf;
+    int thumbSize;
+
+    if (useMainbufForThumb) {
+        thumbBuf = mArgs.out_buf;
+        thumbSize = mArgs.enc_param->file_size;
+    } else {
+        thumbBuf = mArgs.out_thumb_buf;
+        thumbSize = mArgs.thumb_enc_param->file_size;
+    }
+
+    bool hasThumb = exifInfo->enableThumb && (thumbBuf != NULL) && (thumbSize > 0);
+
+    if (exifTemplate != NULL && exifTemplate->matches(exifInfo, hasThumb)) {
+        exifTemplate->apply(exifOut, exifInfo, thumbBuf, thumbSize, size);
+        LOGD("makeExif X");
+        return JPG_SUCCESS;
+    }
+
     unsigned char *pCur, *pApp1Start, *pIfdStart, *pGpsIfdPtr, *pNextIfdOffset;
     unsigned int tmp, LongerTagOffest = 0;
     pApp1Start = pCur = exifOut;
@@ -459,10 +887,11 @@ jpg_return_status JpegEncoder::makeExif (unsigned char *exifOut,
                  1, &exifInfo->focal_length, &LongerTagOffest, pIfdStart);
     char code[8] = { 0x00, 0x00, 0x00, 0x49, 0x49, 0x43, 0x53, 0x41 };
     int commentsLen = strlen((char *)exifInfo->user_comment) + 1;
-    memmove(exifInfo->user_comment + sizeof(code), exifInfo->user_comment, commentsLen);
-    memcpy(exifInfo->user_comment, code, sizeof(code));
+    unsigned char comments[sizeof(code) + sizeof(exifInfo->user_comment)];
+    memcpy(comments, code, sizeof(code));
+    memcpy(comments + sizeof(code), exifInfo->user_comment, commentsLen);
     writeExifIfd(&pCur, EXIF_TAG_USER_COMMENT, EXIF_TYPE_UNDEFINED,
-                 commentsLen + sizeof(code), exifInfo->user_comment, &LongerTagOffest, pIfdStart);
+                 commentsLen + sizeof(code), comments, &LongerTagOffest, pIfdStart);
     writeExifIfd(&pCur, EXIF_TAG_COLOR_SPACE, EXIF_TYPE_SHORT,
                  1, exifInfo->color_space);
     writeExifIfd(&pCur, EXIF_TAG_PIXEL_X_DIMENSION, EXIF_TYPE_LONG,
@@ -532,18 +961,7 @@ jpg_return_status JpegEncoder::makeExif (unsigned char *exifOut,
     }
 
     //2 1th IFD TIFF Tags
-    char *thumbBuf;
-    int thumbSize;
-
-    if (useMainbufForThumb) {
-        thumbBuf = mArgs.out_buf;
-        thumbSize = mArgs.enc_param->file_size;
-    } else {
-        thumbBuf = mArgs.out_thumb_buf;
-        thumbSize = mArgs.thumb_enc_param->file_size;
-    }
-
-    if (exifInfo->enableThumb && (thumbBuf != NULL) && (thumbSize > 0)) {
+    if (hasThumb) {
         tmp = LongerTagOffest;
         memcpy(pNextIfdOffset, &tmp, OFFSET_SIZE);  // NEXT IFD offset skipped on 0th IFD
 
@@ -595,6 +1013,9 @@ jpg_return_status JpegEncoder::makeExif (unsigned char *exifOut,
     unsigned char size_mm[2] = {(tmp >> 8) & 0xFF, tmp & 0xFF};
     memcpy(pApp1Start, size_mm, 2);
 
+    if (exifTemplate != NULL)
+        exifTemplate->compile(exifOut, *size - (hasThumb ? thumbSize : 0), exifInfo, hasThumb);
+
     LOGD("makeExif X");
 
     return JPG_SUCCESS;
@@ -634,87 +1055,263 @@ jpg_return_status JpegEncoder::checkMcu(sample_mode_t sampleMode,
 
     LOGW("The image is not matched for MCU");
 
-    uint32_t size = width*height * 2;
-    char *srcBuf, *dstBuf;
+    char *buf = isThumb ? mArgs.in_thumb_buf : mArgs.in_buf;
+    uint32_t bufSize = isThumb ? JPG_FRAME_THUMB_BUF_SIZE : JPG_FRAME_BUF_SIZE;
 
-    if ((srcBuf = new char[size]) == NULL) {
-        LOGE("Failed to allocate for srcBuf");
+    if (expectedWidth * expectedHeight * 2 > bufSize) {
+        LOGE("The padded image doesn't fit the frame buffer");
         return JPG_FAIL;
     }
 
-    if (!isThumb)
-        dstBuf = mArgs.in_buf;
-    else
-        dstBuf = mArgs.in_thumb_buf;
-
-    memcpy(srcBuf, dstBuf, size);
-    bool ret = pad(srcBuf, width, height, dstBuf, expectedWidth, expectedHeight);
-
-    delete[] srcBuf;
+    if (!pad(buf, width, height, expectedWidth, expectedHeight))
+        return JPG_FAIL;
 
     return JPG_SUCCESS;
 }
 
-bool JpegEncoder::pad(char *srcBuf, uint32_t srcWidth, uint32_t srcHight,
-                        char *dstBuf, uint32_t dstWidth, uint32_t dstHight)
+/* widens the YUYV image in buf to dstWidth x dstHight in place.  lines
+ * only ever move to higher addresses, so they are moved last to first
+ * and none is overwritten before it has been moved.  only the new
+ * columns and lines are cleared.
+ */
+bool JpegEncoder::pad(char *buf, uint32_t srcWidth, uint32_t srcHight,
+                      uint32_t dstWidth, uint32_t dstHight)
 {
     if (!available)
         return false;
 
-    if (srcBuf == NULL || dstBuf == NULL) {
-        LOGE("srcBuf or dstBuf is NULL");
+    if (buf == NULL) {
+        LOGE("buf is NULL");
         return false;
     }
 
-    int padW = dstWidth - srcWidth;
-    int padH = dstHight - srcHight;
-
-    if ((int)(dstWidth - srcWidth) < 0 ||
-            (int)(dstHight - srcHight) < 0) {
+    if (dstWidth < srcWidth || dstHight < srcHight) {
         LOGE("dstSize is smaller than srcSize");
         return false;
     }
-    memset(dstBuf, 0, dstWidth*dstHight * 2);
 
-    for (uint32_t i = 0; i < srcHight; i++)
-        memcpy(dstBuf + i * dstWidth * 2, srcBuf + i * srcWidth * 2, srcWidth * 2);
+    uint32_t srcStride = srcWidth * 2;
+    uint32_t dstStride = dstWidth * 2;
+
+    if (dstStride != srcStride) {
+        for (uint32_t i = srcHight; i-- > 0;) {
+            char *line = buf + i * dstStride;
+
+            if (i > 0)
+                memmove(line, buf + i * srcStride, srcStride);
+            memset(line + srcStride, 0, dstStride - srcStride);
+        }
+    }
+    memset(buf + srcHight * dstStride, 0, (dstHight - srcHight) * dstStride);
 
     return true;
 }
 
-bool JpegEncoder::scaleDownYuv422(char *srcBuf, uint32_t srcWidth, uint32_t srcHight,
-                                  char *dstBuf, uint32_t dstWidth, uint32_t dstHight)
+/* IFD and tag of every ExifTemplate field, in FIELD_* order */
+enum {
+    EXIF_IFD_0TH,
+    EXIF_IFD_EXIF,
+    EXIF_IFD_GPS,
+    EXIF_IFD_1TH,
+    EXIF_IFD_MAX,
+};
+
+static const struct {
+    int             ifd;
+    unsigned short  tag;
+} ExifTemplateFields[] = {
+    { EXIF_IFD_0TH,  EXIF_TAG_IMAGE_WIDTH },
+    { EXIF_IFD_0TH,  EXIF_TAG_IMAGE_HEIGHT },
+    { EXIF_IFD_0TH,  EXIF_TAG_ORIENTATION },
+    { EXIF_IFD_0TH,  EXIF_TAG_DATE_TIME },
+    { EXIF_IFD_EXIF, EXIF_TAG_EXPOSURE_TIME },
+    { EXIF_IFD_EXIF, EXIF_TAG_ISO_SPEED_RATING },
+    { EXIF_IFD_EXIF, EXIF_TAG_DATE_TIME_ORG },
+    { EXIF_IFD_EXIF, EXIF_TAG_DATE_TIME_DIGITIZE },
+    { EXIF_IFD_EXIF, EXIF_TAG_SHUTTER_SPEED },
+    { EXIF_IFD_EXIF, EXIF_TAG_BRIGHTNESS },
+    { EXIF_IFD_EXIF, EXIF_TAG_EXPOSURE_BIAS },
+    { EXIF_IFD_EXIF, EXIF_TAG_METERING_MODE },
+    { EXIF_IFD_EXIF, EXIF_TAG_FLASH },
+    { EXIF_IFD_EXIF, EXIF_TAG_PIXEL_X_DIMENSION },
+    { EXIF_IFD_EXIF, EXIF_TAG_PIXEL_Y_DIMENSION },
+    { EXIF_IFD_EXIF, EXIF_TAG_WHITE_BALANCE },
+    { EXIF_IFD_EXIF, EXIF_TAG_SCENCE_CAPTURE_TYPE },
+    { EXIF_IFD_GPS,  EXIF_TAG_GPS_LATITUDE_REF },
+    { EXIF_IFD_GPS,  EXIF_TAG_GPS_LATITUDE },
+    { EXIF_IFD_GPS,  EXIF_TAG_GPS_LONGITUDE_REF },
+    { EXIF_IFD_GPS,  EXIF_TAG_GPS_LONGITUDE },
+    { EXIF_IFD_GPS,  EXIF_TAG_GPS_ALTITUDE_REF },
+    { EXIF_IFD_GPS,  EXIF_TAG_GPS_ALTITUDE },
+    { EXIF_IFD_GPS,  EXIF_TAG_GPS_TIMESTAMP },
+    { EXIF_IFD_GPS,  EXIF_TAG_GPS_PROCESSING_METHOD },
+    { EXIF_IFD_GPS,  EXIF_TAG_GPS_DATESTAMP },
+    { EXIF_IFD_1TH,  EXIF_TAG_IMAGE_WIDTH },
+    { EXIF_IFD_1TH,  EXIF_TAG_IMAGE_HEIGHT },
+    { EXIF_IFD_1TH,  EXIF_TAG_ORIENTATION },
+    { EXIF_IFD_1TH,  EXIF_TAG_JPEG_INTERCHANGE_FORMAT_LEN },
+};
+
+/* the TIFF header follows the APP1 marker, length and Exif identifier */
+#define EXIF_TIFF_START     10
+
+static unsigned int gpsProcessingMethodLen(exif_attribute_t *exifInfo)
 {
-    if (!available)
+    unsigned int len = strlen((char *)exifInfo->gps_processing_method);
+    return len > 100 ? 100 : len;
+}
+
+bool ExifTemplate::matches(exif_attribute_t *exifInfo, bool hasThumb) const
+{
+    if (!mValid || mGps != exifInfo->enableGps || mThumb != hasThumb)
         return false;
 
-    int32_t step_x, step_y;
-    int32_t iXsrc, iXdst;
-    int32_t x, y, src_y_start_pos, dst_pos, src_pos;
+    return !mGps || mGpsMethodLen == gpsProcessingMethodLen(exifInfo);
+}
+
+/* offset in mBuf of the value of tag in the IFD at ifd, or 0 */
+unsigned int ExifTemplate::findValue(unsigned int ifd, unsigned short tag) const
+{
+    static const unsigned int typeSize[] = { 0, 1, 1, 2, 4, 8, 0, 1, 0, 4, 8 };
+    uint16_t num;
+
+    if (ifd == 0 || EXIF_TIFF_START + ifd + NUM_SIZE > mSize)
+        return 0;
+
+    memcpy(&num, mBuf + EXIF_TIFF_START + ifd, NUM_SIZE);
+    unsigned int entry = EXIF_TIFF_START + ifd + NUM_SIZE;
+    if (entry + num * IFD_SIZE > mSize)
+        return 0;
+
+    for (int i = 0; i < num; i++, entry += IFD_SIZE) {
+        uint16_t entryTag, type;
+        uint32_t count, value;
+
+        memcpy(&entryTag, mBuf + entry, 2);
+        if (entryTag != tag)
+            continue;
+
+        memcpy(&type, mBuf + entry + 2, 2);
+        memcpy(&count, mBuf + entry + 4, 4);
+        if (type >= sizeof(typeSize) / sizeof(typeSize[0]))
+            return 0;
+        if (typeSize[type] * count <= 4)
+            return entry + 8;
+
+        memcpy(&value, mBuf + entry + 8, 4);
+        if (EXIF_TIFF_START + value + typeSize[type] * count > mSize)
+            return 0;
+        return EXIF_TIFF_START + value;
+    }
 
-    if (dstWidth % 2 != 0 || dstHight % 2 != 0){
-        LOGE("scale_down_yuv422: invalid width, height for scaling");
-        return false;
+    return 0;
+}
+
+void ExifTemplate::compile(const unsigned char *exif, unsigned int size,
+                           exif_attribute_t *exifInfo, bool hasThumb)
+{
+    mValid = false;
+    if (size > MAX_SIZE)
+        return;
+
+    memcpy(mBuf, exif, size);
+    mSize = size;
+    mGps = exifInfo->enableGps;
+    mThumb = hasThumb;
+    mGpsMethodLen = gpsProcessingMethodLen(exifInfo);
+
+    unsigned int ifd[EXIF_IFD_MAX] = { 8, 0, 0, 0 };
+    unsigned int value;
+    uint16_t num;
+
+    value = findValue(ifd[EXIF_IFD_0TH], EXIF_TAG_EXIF_IFD_POINTER);
+    if (value != 0)
+        memcpy(&ifd[EXIF_IFD_EXIF], mBuf + value, 4);
+    if (mGps) {
+        value = findValue(ifd[EXIF_IFD_0TH], EXIF_TAG_GPS_IFD_POINTER);
+        if (value != 0)
+            memcpy(&ifd[EXIF_IFD_GPS], mBuf + value, 4);
+    }
+    if (mThumb) {
+        memcpy(&num, mBuf + EXIF_TIFF_START + ifd[EXIF_IFD_0TH], NUM_SIZE);
+        memcpy(&ifd[EXIF_IFD_1TH],
+               mBuf + EXIF_TIFF_START + ifd[EXIF_IFD_0TH] + NUM_SIZE + num * IFD_SIZE,
+               OFFSET_SIZE);
     }
 
-    step_x = srcWidth / dstWidth;
-    step_y = srcHight / dstHight;
+    for (int i = 0; i < FIELD_MAX; i++)
+        mOffset[i] = findValue(ifd[ExifTemplateFields[i].ifd], ExifTemplateFields[i].tag);
+
+    mValid = true;
+}
 
-    dst_pos = 0;
-    for (uint32_t y = 0; y < dstHight; y++) {
-        src_y_start_pos = (y * step_y * (srcWidth * 2));
+void ExifTemplate::putValue(unsigned char *exifOut, int field, uint32_t value) const
+{
+    if (mOffset[field] != 0)
+        memcpy(exifOut + mOffset[field], &value, 4);
+}
 
-        for (uint32_t x = 0; x < dstWidth; x += 2) {
-            src_pos = src_y_start_pos + (x * (step_x * 2));
+void ExifTemplate::putData(unsigned char *exifOut, int field,
+                           const void *data, unsigned int len) const
+{
+    if (mOffset[field] != 0)
+        memcpy(exifOut + mOffset[field], data, len);
+}
 
-            dstBuf[dst_pos++] = srcBuf[src_pos    ];
-            dstBuf[dst_pos++] = srcBuf[src_pos + 1];
-            dstBuf[dst_pos++] = srcBuf[src_pos + 2];
-            dstBuf[dst_pos++] = srcBuf[src_pos + 3];
+void ExifTemplate::apply(unsigned char *exifOut, exif_attribute_t *exifInfo,
+                         const char *thumbBuf, int thumbSize, unsigned int *size) const
+{
+    memcpy(exifOut, mBuf, mSize);
+
+    putValue(exifOut, FIELD_WIDTH, exifInfo->width);
+    putValue(exifOut, FIELD_HEIGHT, exifInfo->height);
+    putValue(exifOut, FIELD_ORIENTATION, exifInfo->orientation);
+    putData(exifOut, FIELD_DATE_TIME, exifInfo->date_time, 20);
+
+    putData(exifOut, FIELD_EXPOSURE_TIME, &exifInfo->exposure_time, 8);
+    putValue(exifOut, FIELD_ISO_SPEED_RATING, exifInfo->iso_speed_rating);
+    putData(exifOut, FIELD_DATE_TIME_ORG, exifInfo->date_time, 20);
+    putData(exifOut, FIELD_DATE_TIME_DIGITIZE, exifInfo->date_time, 20);
+    putData(exifOut, FIELD_SHUTTER_SPEED, &exifInfo->shutter_speed, 8);
+    putData(exifOut, FIELD_BRIGHTNESS, &exifInfo->brightness, 8);
+    putData(exifOut, FIELD_EXPOSURE_BIAS, &exifInfo->exposure_bias, 8);
+    putValue(exifOut, FIELD_METERING_MODE, exifInfo->metering_mode);
+    putValue(exifOut, FIELD_FLASH, exifInfo->flash);
+    putValue(exifOut, FIELD_PIXEL_X_DIMENSION, exifInfo->width);
+    putValue(exifOut, FIELD_PIXEL_Y_DIMENSION, exifInfo->height);
+    putValue(exifOut, FIELD_WHITE_BALANCE, exifInfo->white_balance);
+    putValue(exifOut, FIELD_SCENE_CAPTURE_TYPE, exifInfo->scene_capture_type);
+
+    if (mGps) {
+        putData(exifOut, FIELD_GPS_LATITUDE_REF, exifInfo->gps_latitude_ref, 2);
+        putData(exifOut, FIELD_GPS_LATITUDE, exifInfo->gps_latitude, 8 * 3);
+        putData(exifOut, FIELD_GPS_LONGITUDE_REF, exifInfo->gps_longitude_ref, 2);
+        putData(exifOut, FIELD_GPS_LONGITUDE, exifInfo->gps_longitude, 8 * 3);
+        putValue(exifOut, FIELD_GPS_ALTITUDE_REF, exifInfo->gps_altitude_ref);
+        putData(exifOut, FIELD_GPS_ALTITUDE, &exifInfo->gps_altitude, 8);
+        putData(exifOut, FIELD_GPS_TIMESTAMP, exifInfo->gps_timestamp, 8 * 3);
+        if (mGpsMethodLen > 0 && mOffset[FIELD_GPS_PROCESSING_METHOD] != 0) {
+            memcpy(exifOut + mOffset[FIELD_GPS_PROCESSING_METHOD],
+                   ExifAsciiPrefix, sizeof(ExifAsciiPrefix));
+            memcpy(exifOut + mOffset[FIELD_GPS_PROCESSING_METHOD] + sizeof(ExifAsciiPrefix),
+                   exifInfo->gps_processing_method, mGpsMethodLen);
         }
+        putData(exifOut, FIELD_GPS_DATESTAMP, exifInfo->gps_datestamp, 11);
     }
 
-    return true;
+    *size = mSize;
+    if (mThumb) {
+        putValue(exifOut, FIELD_THUMB_WIDTH, exifInfo->widthThumb);
+        putValue(exifOut, FIELD_THUMB_HEIGHT, exifInfo->heightThumb);
+        putValue(exifOut, FIELD_THUMB_ORIENTATION, exifInfo->orientation);
+        putValue(exifOut, FIELD_THUMB_LENGTH, thumbSize);
+        memcpy(exifOut + mSize, thumbBuf, thumbSize);
+        *size += thumbSize;
+    }
+
+    unsigned int len = *size - 2;    // APP1 Maker isn't counted
+    exifOut[2] = (len >> 8) & 0xFF;
+    exifOut[3] = len & 0xFF;
 }
 
 inline void JpegEncoder::writeExifIfd(unsigned char **pCur,
@@ -37,6 +37,10 @@ namespace android {
 #define MAX_JPG_THUMBNAIL_RESOLUTION    (MAX_JPG_THUMBNAIL_WIDTH *  \
                                             MAX_JPG_THUMBNAIL_HEIGHT)
 
+/* the software encoder isn't bound by the device buffers */
+#define MAX_SW_JPG_WIDTH                8192
+#define MAX_SW_JPG_HEIGHT               8192
+
 #define MAX_RGB_WIDTH                   800
 #define MAX_RGB_HEIGHT                  480
 #define MAX_RGB_RESOLUTION              (MAX_RGB_WIDTH * MAX_RGB_HEIGHT)
@@ -86,7 +90,8 @@ typedef enum {
     JPEG_SET_ENCODE_IN_FORMAT,
     JPEG_SET_SAMPING_MODE,
     JPEG_SET_THUMBNAIL_WIDTH,
-    JPEG_SET_THUMBNAIL_HEIGHT
+    JPEG_SET_THUMBNAIL_HEIGHT,
+    JPEG_SET_ENCODE_TARGET_SIZE     /* bytes for the next main image, 0 for off */
 } jpeg_conf;
 
 typedef enum {
@@ -181,30 +186,114 @@ typedef struct {
     jpg_enc_proc_param  *thumb_enc_param;
 } jpg_args;
 
+/* An EXIF segment made by JpegEncoder::makeExif() without its thumbnail
+ * data, with the location of every attribute that changes from shot to
+ * shot.  While the layout (GPS, GPS processing method, thumbnail) stays
+ * the same, makeExif() copies it and patches those attributes instead of
+ * serializing every IFD again.  Call invalidate() after changing any
+ * other attribute.
+ */
+class ExifTemplate {
+public:
+    ExifTemplate() : mValid(false) {}
+    void invalidate() { mValid = false; }
+
+private:
+    friend class JpegEncoder;
+
+    enum {
+        MAX_SIZE = 2048,
+    };
+
+    enum {
+        FIELD_WIDTH,
+        FIELD_HEIGHT,
+        FIELD_ORIENTATION,
+        FIELD_DATE_TIME,
+        FIELD_EXPOSURE_TIME,
+        FIELD_ISO_SPEED_RATING,
+        FIELD_DATE_TIME_ORG,
+        FIELD_DATE_TIME_DIGITIZE,
+        FIELD_SHUTTER_SPEED,
+        FIELD_BRIGHTNESS,
+        FIELD_EXPOSURE_BIAS,
+        FIELD_METERING_MODE,
+        FIELD_FLASH,
+        FIELD_PIXEL_X_DIMENSION,
+        FIELD_PIXEL_Y_DIMENSION,
+        FIELD_WHITE_BALANCE,
+        FIELD_SCENE_CAPTURE_TYPE,
+        FIELD_GPS_LATITUDE_REF,
+        FIELD_GPS_LATITUDE,
+        FIELD_GPS_LONGITUDE_REF,
+        FIELD_GPS_LONGITUDE,
+        FIELD_GPS_ALTITUDE_REF,
+        FIELD_GPS_ALTITUDE,
+        FIELD_GPS_TIMESTAMP,
+        FIELD_GPS_PROCESSING_METHOD,
+        FIELD_GPS_DATESTAMP,
+        FIELD_THUMB_WIDTH,
+        FIELD_THUMB_HEIGHT,
+        FIELD_THUMB_ORIENTATION,
+        FIELD_THUMB_LENGTH,
+        FIELD_MAX,
+    };
+
+    bool matches(exif_attribute_t *exifInfo, bool hasThumb) const;
+    void compile(const unsigned char *exif, unsigned int size,
+                 exif_attribute_t *exifInfo, bool hasThumb);
+    void apply(unsigned char *exifOut, exif_attribute_t *exifInfo,
+               const char *thumbBuf, int thumbSize, unsigned int *size) const;
+
+    unsigned int findValue(unsigned int ifd, unsigned short tag) const;
+    void putValue(unsigned char *exifOut, int field, uint32_t value) const;
+    void putData(unsigned char *exifOut, int field,
+                 const void *data, unsigned int len) const;
+
+    bool            mValid;
+    bool            mGps;
+    bool            mThumb;
+    unsigned int    mGpsMethodLen;
+    unsigned int    mSize;
+    unsigned int    mOffset[FIELD_MAX];
+    unsigned char   mBuf[MAX_SIZE];
+};
+
 class JpegEncoder {
 public:
     JpegEncoder();
     virtual ~JpegEncoder();
 
     int openHardware();
+    void closeHardware();
     jpg_return_status setConfig(jpeg_conf type, int32_t value);
     void *getInBuf(uint64_t size);
-    void *getOutBuf(uint64_t *size);
+    /* the encoder's stream without the EXIF; encode() and copyOutBuf()
+     * count the EXIF in, so *size here is smaller by its length
+     */
+    void *getStreamBuf(uint64_t *size);
+    jpg_return_status copyOutBuf(void *dst, unsigned int *size);
     void *getThumbInBuf(uint64_t size);
     void *getThumbOutBuf(uint64_t *size);
-    jpg_return_status encode(unsigned int *size, exif_attribute_t *exifInfo);
+    jpg_return_status encode(unsigned int *size, exif_attribute_t *exifInfo,
+                             ExifTemplate *exifTemplate = NULL);
     jpg_return_status encodeThumbImg(unsigned int *size, bool useMain = true);
     jpg_return_status makeExif(unsigned char *exifOut,
                                exif_attribute_t *exifIn,
                                unsigned int *size,
-                               bool useMainbufForThumb = false);
+                               bool useMainbufForThumb = false,
+                               ExifTemplate *exifTemplate = NULL);
 
 private:
+    char *getBuffer(int request, uint64_t size);
+    jpg_return_status encodeImage(bool isThumb);
+    jpg_return_status encodeToSize(float activity, uint32_t targetSize);
+    float qualityScale(int quality) const;
+    int qualityForScale(float scale) const;
+    void setQuality(int quality);
     jpg_return_status checkMcu(sample_mode_t sampleMode, uint32_t width, uint32_t height, bool isThumb);
-    bool pad(char *srcBuf, uint32_t srcWidth, uint32_t srcHight,
-             char *dstBuf, uint32_t dstWidth, uint32_t dstHight);
-    bool scaleDownYuv422(char *srcBuf, uint32_t srcWidth, uint32_t srcHight,
-                         char *dstBuf, uint32_t dstWidth, uint32_t dstHight);
+    bool pad(char *buf, uint32_t srcWidth, uint32_t srcHight,
+             uint32_t dstWidth, uint32_t dstHight);
 
     inline void writeExifIfd(unsigned char **pCur,
                                  unsigned short tag,
@@ -233,6 +322,24 @@ private:
     int mDevFd;
     jpg_args mArgs;
 
+    /* EXIF made by encode(), inserted by copyOutBuf() */
+    unsigned char *mExifOut;
+    unsigned int mExifLen;
+
+    /* no usable JPEG block, encode with SwJpegEncoder into heap buffers
+     * standing in for the mapped ones.  set until openHardware() succeeds.
+     */
+    bool mSoftware;
+    char *mSwBuf[4];
+    uint64_t mSwBufSize[4];
+
+    /* target size mode, see encodeToSize().  mTargetSize is taken by the
+     * next encode().  mSwQuality overrides the quality level of the main
+     * image in software while it runs.
+     */
+    uint32_t mTargetSize;
+    int mSwQuality;
+
     bool available;
 
 };
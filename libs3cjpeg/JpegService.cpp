@@ -0,0 +1,181 @@
+/*
+ * Copyright (C) 2010 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#define LOG_TAG "JpegService"
+
+#include <utils/Log.h>
+
+#include "JpegService.h"
+
+namespace android {
+
+static pthread_once_t sServiceOnce = PTHREAD_ONCE_INIT;
+static JpegService *sService;
+
+void JpegService::createInstance()
+{
+    sService = new JpegService;
+}
+
+JpegService *JpegService::getInstance()
+{
+    pthread_once(&sServiceOnce, createInstance);
+    return sService;
+}
+
+JpegService::JpegService()
+    : mStarted(false),
+      mExit(false),
+      mHead(NULL),
+      mTail(NULL),
+      mEncoder(NULL)
+{
+    pthread_mutex_init(&mLock, NULL);
+    pthread_cond_init(&mJobCond, NULL);
+    pthread_cond_init(&mDoneCond, NULL);
+}
+
+jpg_return_status JpegService::submit(JpegJob *job)
+{
+    pthread_mutex_lock(&mLock);
+
+    if (mExit) {
+        pthread_mutex_unlock(&mLock);
+        LOGE("%s: the service is shutting down", __func__);
+        return JPG_FAIL;
+    }
+
+    if (!mStarted) {
+        if (pthread_create(&mThread, NULL, threadEntry, this) != 0) {
+            pthread_mutex_unlock(&mLock);
+            LOGE("%s: failed to start the service thread", __func__);
+            return JPG_FAIL;
+        }
+        mStarted = true;
+    }
+
+    job->mNext = NULL;
+    job->mDone = false;
+    job->mStatus = JPG_FAIL;
+    if (mTail != NULL)
+        mTail->mNext = job;
+    else
+        mHead = job;
+    mTail = job;
+
+    pthread_cond_signal(&mJobCond);
+    pthread_mutex_unlock(&mLock);
+
+    return JPG_SUCCESS;
+}
+
+jpg_return_status JpegService::wait(JpegJob *job)
+{
+    jpg_return_status status;
+
+    pthread_mutex_lock(&mLock);
+    while (!job->mDone)
+        pthread_cond_wait(&mDoneCond, &mLock);
+    status = job->mStatus;
+    pthread_mutex_unlock(&mLock);
+
+    return status;
+}
+
+jpg_return_status JpegService::run(JpegJob *job)
+{
+    jpg_return_status status = submit(job);
+
+    if (status != JPG_SUCCESS)
+        return status;
+
+    return wait(job);
+}
+
+void JpegService::shutdown()
+{
+    pthread_mutex_lock(&mLock);
+    if (!mStarted) {
+        pthread_mutex_unlock(&mLock);
+        return;
+    }
+    mExit = true;
+    pthread_cond_signal(&mJobCond);
+    pthread_mutex_unlock(&mLock);
+
+    pthread_join(mThread, NULL);
+
+    pthread_mutex_lock(&mLock);
+    mStarted = false;
+    mExit = false;
+    pthread_mutex_unlock(&mLock);
+}
+
+void *JpegService::threadEntry(void *arg)
+{
+    static_cast<JpegService *>(arg)->threadLoop();
+    return NULL;
+}
+
+void JpegService::threadLoop()
+{
+    mEncoder = new JpegEncoder;
+
+    pthread_mutex_lock(&mLock);
+    while (1) {
+        if (mHead == NULL && !mExit) {
+            struct timespec ts;
+
+            clock_gettime(CLOCK_REALTIME, &ts);
+            ts.tv_sec += kIdleTimeoutMs / 1000;
+            ts.tv_nsec += (kIdleTimeoutMs % 1000) * 1000000;
+            if (ts.tv_nsec >= 1000000000) {
+                ts.tv_sec++;
+                ts.tv_nsec -= 1000000000;
+            }
+            pthread_cond_timedwait(&mJobCond, &mLock, &ts);
+
+            /* idle, let other clients have the block */
+            if (mHead == NULL)
+                mEncoder->closeHardware();
+        }
+        while (mHead == NULL && !mExit)
+            pthread_cond_wait(&mJobCond, &mLock);
+        if (mHead == NULL)
+            break;
+
+        JpegJob *job = mHead;
+        mHead = job->mNext;
+        if (mHead == NULL)
+            mTail = NULL;
+        pthread_mutex_unlock(&mLock);
+
+        /* a no-op while the block is mapped, otherwise tries it again */
+        mEncoder->openHardware();
+        jpg_return_status status = job->run(mEncoder);
+        job->onComplete(status);
+
+        pthread_mutex_lock(&mLock);
+        job->mStatus = status;
+        job->mDone = true;
+        pthread_cond_broadcast(&mDoneCond);
+    }
+    pthread_mutex_unlock(&mLock);
+
+    delete mEncoder;
+    mEncoder = NULL;
+}
+
+}; // namespace android
@@ -0,0 +1,93 @@
+/*
+ * Copyright (C) 2010 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Process wide access to the JPEG block.  Work for it is queued as jobs
+ * that run one at a time on the service thread, so a caller can do CPU
+ * work while its encode runs.  The device is mapped when a job comes in
+ * and given back once the service has been idle for a while.
+ */
+#ifndef __JPEG_SERVICE_H__
+#define __JPEG_SERVICE_H__
+
+#include <pthread.h>
+#include <time.h>
+
+#include "JpegEncoder.h"
+
+namespace android {
+
+class JpegService;
+
+/* one unit of work for the JPEG block.  run() has the encoder to itself;
+ * onComplete() follows on the service thread, before wait() returns.
+ * the job must stay alive until it has completed.
+ */
+class JpegJob {
+public:
+    JpegJob() : mNext(NULL), mDone(false), mStatus(JPG_FAIL) {}
+    virtual ~JpegJob() {}
+
+    virtual jpg_return_status run(JpegEncoder *encoder) = 0;
+    virtual void onComplete(jpg_return_status status) {}
+
+private:
+    friend class JpegService;
+
+    JpegJob             *mNext;
+    bool                mDone;
+    jpg_return_status   mStatus;
+};
+
+class JpegService {
+public:
+    static JpegService *getInstance();
+
+    /* queues job and returns at once, or fails if the service thread
+     * couldn't be started
+     */
+    jpg_return_status submit(JpegJob *job);
+    /* blocks until a submitted job has completed, returns its status */
+    jpg_return_status wait(JpegJob *job);
+    /* submit() and wait() */
+    jpg_return_status run(JpegJob *job);
+    /* runs the queued jobs, then stops the service thread and frees the
+     * encoder.  the next submit() starts them again.
+     */
+    void shutdown();
+
+private:
+    JpegService();
+
+    /* how long the device stays mapped after the last job */
+    static const int kIdleTimeoutMs = 1000;
+
+    static void createInstance();
+    static void *threadEntry(void *arg);
+    void threadLoop();
+
+    pthread_mutex_t mLock;
+    pthread_cond_t  mJobCond;
+    pthread_cond_t  mDoneCond;
+    pthread_t       mThread;
+    bool            mStarted;
+    bool            mExit;
+    JpegJob         *mHead;
+    JpegJob         *mTail;
+    JpegEncoder     *mEncoder;  /* created on the service thread */
+};
+
+}; // namespace android
+
+#endif // __JPEG_SERVICE_H__
@@ -0,0 +1,723 @@
+/*
+ * Copyright (C) 2010 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#define LOG_TAG "SwJpegEncoder"
+
+#include <utils/Log.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#if defined(__ARM_NEON__)
+#include <arm_neon.h>
+#endif
+
+#include "SwJpegEncoder.h"
+
+namespace android {
+
+#define MAX_SW_THREADS      8
+/* worst case of one MCU after byte stuffing: six blocks of DC, 63 AC
+ * codes with their bits and no zero runs, every byte stuffed
+ */
+#define MAX_MCU_BYTES       (6 * 2 * (27 + 63 * 26) / 8 + 16)
+
+/* zigzag index to natural order */
+static const uint8_t zigzag[64] = {
+     0,  1,  8, 16,  9,  2,  3, 10, 17, 24, 32, 25, 18, 11,  4,  5,
+    12, 19, 26, 33, 40, 48, 41, 34, 27, 20, 13,  6,  7, 14, 21, 28,
+    35, 42, 49, 56, 57, 50, 43, 36, 29, 22, 15, 23, 30, 37, 44, 51,
+    58, 59, 52, 45, 38, 31, 39, 46, 53, 60, 61, 54, 47, 55, 62, 63,
+};
+
+/* ITU-T T.81 Annex K tables, natural order */
+static const uint8_t lumaQuant[64] = {
+    16,  11,  10,  16,  24,  40,  51,  61,
+    12,  12,  14,  19,  26,  58,  60,  55,
+    14,  13,  16,  24,  40,  57,  69,  56,
+    14,  17,  22,  29,  51,  87,  80,  62,
+    18,  22,  37,  56,  68, 109, 103,  77,
+    24,  35,  55,  64,  81, 104, 113,  92,
+    49,  64,  78,  87, 103, 121, 120, 101,
+    72,  92,  95,  98, 112, 100, 103,  99,
+};
+
+static const uint8_t chromaQuant[64] = {
+    17,  18,  24,  47,  99,  99,  99,  99,
+    18,  21,  26,  66,  99,  99,  99,  99,
+    24,  26,  56,  99,  99,  99,  99,  99,
+    47,  66,  99,  99,  99,  99,  99,  99,
+    99,  99,  99,  99,  99,  99,  99,  99,
+    99,  99,  99,  99,  99,  99,  99,  99,
+    99,  99,  99,  99,  99,  99,  99,  99,
+    99,  99,  99,  99,  99,  99,  99,  99,
+};
+
+static const uint8_t dcLumaBits[16] = {
+    0, 1, 5, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 0, 0,
+};
+
+static const uint8_t dcChromaBits[16] = {
+    0, 3, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0,
+};
+
+static const uint8_t dcValues[12] = {
+    0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11,
+};
+
+static const uint8_t acLumaBits[16] = {
+    0, 2, 1, 3, 3, 2, 4, 3, 5, 5, 4, 4, 0, 0, 1, 0x7d,
+};
+
+static const uint8_t acLumaValues[162] = {
+    0x01, 0x02, 0x03, 0x00, 0x04, 0x11, 0x05, 0x12,
+    0x21, 0x31, 0x41, 0x06, 0x13, 0x51, 0x61, 0x07,
+    0x22, 0x71, 0x14, 0x32, 0x81, 0x91, 0xa1, 0x08,
+    0x23, 0x42, 0xb1, 0xc1, 0x15, 0x52, 0xd1, 0xf0,
+    0x24, 0x33, 0x62, 0x72, 0x82, 0x09, 0x0a, 0x16,
+    0x17, 0x18, 0x19, 0x1a, 0x25, 0x26, 0x27, 0x28,
+    0x29, 0x2a, 0x34, 0x35, 0x36, 0x37, 0x38, 0x39,
+    0x3a, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48, 0x49,
+    0x4a, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58, 0x59,
+    0x5a, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69,
+    0x6a, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x79,
+    0x7a, 0x83, 0x84, 0x85, 0x86, 0x87, 0x88, 0x89,
+    0x8a, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98,
+    0x99, 0x9a, 0xa2, 0xa3, 0xa4, 0xa5, 0xa6, 0xa7,
+    0xa8, 0xa9, 0xaa, 0xb2, 0xb3, 0xb4, 0xb5, 0xb6,
+    0xb7, 0xb8, 0xb9, 0xba, 0xc2, 0xc3, 0xc4, 0xc5,
+    0xc6, 0xc7, 0xc8, 0xc9, 0xca, 0xd2, 0xd3, 0xd4,
+    0xd5, 0xd6, 0xd7, 0xd8, 0xd9, 0xda, 0xe1, 0xe2,
+    0xe3, 0xe4, 0xe5, 0xe6, 0xe7, 0xe8, 0xe9, 0xea,
+    0xf1, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7, 0xf8,
+    0xf9, 0xfa,
+};
+
+static const uint8_t acChromaBits[16] = {
+    0, 2, 1, 2, 4, 4, 3, 4, 7, 5, 4, 4, 0, 1, 2, 0x77,
+};
+
+static const uint8_t acChromaValues[162] = {
+    0x00, 0x01, 0x02, 0x03, 0x11, 0x04, 0x05, 0x21,
+    0x31, 0x06, 0x12, 0x41, 0x51, 0x07, 0x61, 0x71,
+    0x13, 0x22, 0x32, 0x81, 0x08, 0x14, 0x42, 0x91,
+    0xa1, 0xb1, 0xc1, 0x09, 0x23, 0x33, 0x52, 0xf0,
+    0x15, 0x62, 0x72, 0xd1, 0x0a, 0x16, 0x24, 0x34,
+    0xe1, 0x25, 0xf1, 0x17, 0x18, 0x19, 0x1a, 0x26,
+    0x27, 0x28, 0x29, 0x2a, 0x35, 0x36, 0x37, 0x38,
+    0x39, 0x3a, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48,
+    0x49, 0x4a, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58,
+    0x59, 0x5a, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68,
+    0x69, 0x6a, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78,
+    0x79, 0x7a, 0x82, 0x83, 0x84, 0x85, 0x86, 0x87,
+    0x88, 0x89, 0x8a, 0x92, 0x93, 0x94, 0x95, 0x96,
+    0x97, 0x98, 0x99, 0x9a, 0xa2, 0xa3, 0xa4, 0xa5,
+    0xa6, 0xa7, 0xa8, 0xa9, 0xaa, 0xb2, 0xb3, 0xb4,
+    0xb5, 0xb6, 0xb7, 0xb8, 0xb9, 0xba, 0xc2, 0xc3,
+    0xc4, 0xc5, 0xc6, 0xc7, 0xc8, 0xc9, 0xca, 0xd2,
+    0xd3, 0xd4, 0xd5, 0xd6, 0xd7, 0xd8, 0xd9, 0xda,
+    0xe2, 0xe3, 0xe4, 0xe5, 0xe6, 0xe7, 0xe8, 0xe9,
+    0xea, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7, 0xf8,
+    0xf9, 0xfa,
+};
+
+struct HuffTable {
+    uint16_t    code[256];
+    uint8_t     size[256];
+};
+
+/* everything the stripe workers share, read only while they run */
+struct SwJpegContext {
+    const uint8_t   *src;
+    uint32_t        width;
+    uint32_t        height;
+    uint32_t        stride;
+    bool            is420;
+    uint32_t        mcuHeight;
+    uint32_t        mcusPerRow;
+    uint32_t        mcuRows;
+    uint32_t        rowsPerStripe;
+    uint32_t        stripes;
+    uint32_t        threads;
+    uint8_t         quant[2][64];       /* natural order */
+    uint32_t        recip[2][64];       /* 2^26 / (quant * 8), rounded up */
+    HuffTable       dc[2];
+    HuffTable       ac[2];
+};
+
+/* entropy coded output of one restart interval */
+struct SwJpegStripe {
+    uint8_t         *buf;
+    uint32_t        size;
+    uint32_t        len;
+    uint32_t        acc;
+    int             bits;
+};
+
+struct SwJpegWorker {
+    const SwJpegContext *ctx;
+    SwJpegStripe        *stripes;
+    uint32_t            first;
+};
+
+int swJpegQuality(image_quality_type_t level)
+{
+    switch (level) {
+    case JPG_QUALITY_LEVEL_1:
+        return 90;
+    case JPG_QUALITY_LEVEL_2:
+        return 80;
+    case JPG_QUALITY_LEVEL_3:
+        return 70;
+    case JPG_QUALITY_LEVEL_4:
+    default:
+        return 60;
+    }
+}
+
+static void buildHuffTable(const uint8_t *bits, const uint8_t *values, HuffTable *table)
+{
+    uint16_t code = 0;
+    int k = 0;
+
+    memset(table, 0, sizeof(*table));
+    for (int len = 1; len <= 16; len++) {
+        for (int i = 0; i < bits[len - 1]; i++) {
+            table->code[values[k]] = code++;
+            table->size[values[k]] = len;
+            k++;
+        }
+        code <<= 1;
+    }
+}
+
+static void buildQuantTable(const uint8_t *base, int quality, uint8_t *quant, uint32_t *recip)
+{
+    int scale = quality < 50 ? 5000 / quality : 200 - quality * 2;
+
+    for (int i = 0; i < 64; i++) {
+        int q = (base[i] * scale + 50) / 100;
+
+        if (q < 1)
+            q = 1;
+        if (q > 255)
+            q = 255;
+        quant[i] = q;
+        /* exact for the magnitudes the DCT below can produce */
+        recip[i] = ((1 << 26) + q * 8 - 1) / (q * 8);
+    }
+}
+
+/* reads 16 pixels of a YUYV line from x into two 8 sample luma rows and
+ * one 8 sample row of each chroma, level shifted.  past the right edge
+ * the last pixel pair is repeated.
+ */
+static inline void loadLine(const uint8_t *line, uint32_t x, uint32_t width,
+                            int16_t *ya, int16_t *yb, int16_t *cb, int16_t *cr)
+{
+    if (x + 16 <= width) {
+        line += x * 2;
+#if defined(__ARM_NEON__)
+        uint8x8_t bias = vdup_n_u8(128);
+        uint8x8x4_t yuyv = vld4_u8(line);
+        uint8x8x2_t luma = vzip_u8(yuyv.val[0], yuyv.val[2]);
+
+        vst1q_s16(ya, vreinterpretq_s16_u16(vsubl_u8(luma.val[0], bias)));
+        vst1q_s16(yb, vreinterpretq_s16_u16(vsubl_u8(luma.val[1], bias)));
+        vst1q_s16(cb, vreinterpretq_s16_u16(vsubl_u8(yuyv.val[1], bias)));
+        vst1q_s16(cr, vreinterpretq_s16_u16(vsubl_u8(yuyv.val[3], bias)));
+#else
+        for (int i = 0; i < 8; i++) {
+            ya[i] = line[i * 2] - 128;
+            yb[i] = line[16 + i * 2] - 128;
+            cb[i] = line[i * 4 + 1] - 128;
+            cr[i] = line[i * 4 + 3] - 128;
+        }
+#endif
+        return;
+    }
+
+    for (int i = 0; i < 8; i++) {
+        uint32_t xa = x + i < width ? x + i : width - 1;
+        uint32_t xb = x + 8 + i < width ? x + 8 + i : width - 1;
+        uint32_t pair = (x + i * 2 < width ? x + i * 2 : width - 1) & ~1;
+
+        ya[i] = line[xa * 2] - 128;
+        yb[i] = line[xb * 2] - 128;
+        cb[i] = line[pair * 2 + 1] - 128;
+        cr[i] = line[pair * 2 + 3] - 128;
+    }
+}
+
+/* gathers the blocks of the MCU at column mx of the MCU row starting at
+ * line y0: Y in raster order, then Cb and Cr.
+ */
+static void loadMcu(const SwJpegContext *ctx, uint32_t mx, uint32_t y0, int16_t (*blocks)[64])
+{
+    uint32_t x0 = mx * 16;
+    int16_t cb[8], cr[8];
+
+    for (uint32_t r = 0; r < ctx->mcuHeight; r++) {
+        uint32_t y = y0 + r < ctx->height ? y0 + r : ctx->height - 1;
+        const uint8_t *line = ctx->src + y * ctx->stride;
+        int16_t *luma = &blocks[(r >> 3) * 2][(r & 7) * 8];
+        int16_t *lumb = &blocks[(r >> 3) * 2 + 1][(r & 7) * 8];
+
+        if (!ctx->is420) {
+            loadLine(line, x0, ctx->width, luma, lumb,
+                     &blocks[2][(r & 7) * 8], &blocks[3][(r & 7) * 8]);
+            continue;
+        }
+
+        int16_t *dcb = &blocks[4][(r >> 1) * 8];
+        int16_t *dcr = &blocks[5][(r >> 1) * 8];
+
+        if ((r & 1) == 0) {
+            loadLine(line, x0, ctx->width, luma, lumb, dcb, dcr);
+        } else {
+            loadLine(line, x0, ctx->width, luma, lumb, cb, cr);
+            for (int i = 0; i < 8; i++) {
+                dcb[i] = (dcb[i] + cb[i] + 1) >> 1;
+                dcr[i] = (dcr[i] + cr[i] + 1) >> 1;
+            }
+        }
+    }
+}
+
+#define CONST_BITS      13
+#define PASS1_BITS      2
+#define DESCALE(x, n)   (((x) + (1 << ((n) - 1))) >> (n))
+
+#define FIX_0_298631336 2446
+#define FIX_0_390180644 3196
+#define FIX_0_541196100 4433
+#define FIX_0_765366865 6270
+#define FIX_0_899976223 7373
+#define FIX_1_175875602 9633
+#define FIX_1_501321110 12299
+#define FIX_1_847759065 15137
+#define FIX_1_961570560 16069
+#define FIX_2_053119869 16819
+#define FIX_2_562915447 20995
+#define FIX_3_072711026 25172
+
+/* one 8 point pass of the integer LLM forward DCT.  the row pass keeps
+ * PASS1_BITS of extra precision that the column pass takes back out; the
+ * result is the DCT scaled by 8.
+ */
+static inline void fdct8(int32_t *d, int step, int pass)
+{
+    int32_t tmp0 = d[0 * step] + d[7 * step];
+    int32_t tmp7 = d[0 * step] - d[7 * step];
+    int32_t tmp1 = d[1 * step] + d[6 * step];
+    int32_t tmp6 = d[1 * step] - d[6 * step];
+    int32_t tmp2 = d[2 * step] + d[5 * step];
+    int32_t tmp5 = d[2 * step] - d[5 * step];
+    int32_t tmp3 = d[3 * step] + d[4 * step];
+    int32_t tmp4 = d[3 * step] - d[4 * step];
+
+    int32_t tmp10 = tmp0 + tmp3;
+    int32_t tmp13 = tmp0 - tmp3;
+    int32_t tmp11 = tmp1 + tmp2;
+    int32_t tmp12 = tmp1 - tmp2;
+    int shift = pass == 0 ? CONST_BITS - PASS1_BITS : CONST_BITS + PASS1_BITS;
+
+    if (pass == 0) {
+        d[0 * step] = (tmp10 + tmp11) << PASS1_BITS;
+        d[4 * step] = (tmp10 - tmp11) << PASS1_BITS;
+    } else {
+        d[0 * step] = DESCALE(tmp10 + tmp11, PASS1_BITS);
+        d[4 * step] = DESCALE(tmp10 - tmp11, PASS1_BITS);
+    }
+
+    int32_t z1 = (tmp12 + tmp13) * FIX_0_541196100;
+    d[2 * step] = DESCALE(z1 + tmp13 * FIX_0_765366865, shift);
+    d[6 * step] = DESCALE(z1 - tmp12 * FIX_1_847759065, shift);
+
+    z1 = tmp4 + tmp7;
+    int32_t z2 = tmp5 + tmp6;
+    int32_t z3 = tmp4 + tmp6;
+    int32_t z4 = tmp5 + tmp7;
+    int32_t z5 = (z3 + z4) * FIX_1_175875602;
+
+    tmp4 *= FIX_0_298631336;
+    tmp5 *= FIX_2_053119869;
+    tmp6 *= FIX_3_072711026;
+    tmp7 *= FIX_1_501321110;
+    z1 *= -FIX_0_899976223;
+    z2 *= -FIX_2_562915447;
+    z3 = z3 * -FIX_1_961570560 + z5;
+    z4 = z4 * -FIX_0_390180644 + z5;
+
+    d[7 * step] = DESCALE(tmp4 + z1 + z3, shift);
+    d[5 * step] = DESCALE(tmp5 + z2 + z4, shift);
+    d[3 * step] = DESCALE(tmp6 + z2 + z3, shift);
+    d[1 * step] = DESCALE(tmp7 + z1 + z4, shift);
+}
+
+static inline void putBits(SwJpegStripe *out, uint32_t code, int size)
+{
+    out->acc = (out->acc << size) | code;
+    out->bits += size;
+    while (out->bits >= 8) {
+        out->bits -= 8;
+        uint8_t c = out->acc >> out->bits;
+        out->buf[out->len++] = c;
+        if (c == 0xff)
+            out->buf[out->len++] = 0;
+    }
+}
+
+/* pads the last byte of the interval with ones */
+static inline void flushBits(SwJpegStripe *out)
+{
+    if (out->bits > 0)
+        putBits(out, 0x7f, 7);
+    out->bits = 0;
+}
+
+static inline int magnitude(int32_t v)
+{
+    if (v < 0)
+        v = -v;
+    return v == 0 ? 0 : 32 - __builtin_clz(v);
+}
+
+static void encodeBlock(const SwJpegContext *ctx, SwJpegStripe *out, const int16_t *block,
+                        int table, int32_t *lastDc)
+{
+    int32_t ws[64];
+    int32_t coef[64];
+
+    for (int i = 0; i < 64; i++)
+        ws[i] = block[i];
+    for (int i = 0; i < 8; i++)
+        fdct8(&ws[i * 8], 1, 0);
+    for (int i = 0; i < 8; i++)
+        fdct8(&ws[i], 8, 1);
+
+    const uint8_t *quant = ctx->quant[table];
+    const uint32_t *recip = ctx->recip[table];
+    for (int k = 0; k < 64; k++) {
+        int n = zigzag[k];
+        int32_t v = ws[n];
+        uint32_t a = (v < 0 ? -v : v) + quant[n] * 4;
+        int32_t q = (int32_t)(((uint64_t)a * recip[n]) >> 26);
+
+        coef[k] = v < 0 ? -q : q;
+    }
+
+    const HuffTable *dc = &ctx->dc[table];
+    const HuffTable *ac = &ctx->ac[table];
+
+    int32_t diff = coef[0] - *lastDc;
+    int nbits = magnitude(diff);
+
+    *lastDc = coef[0];
+    putBits(out, dc->code[nbits], dc->size[nbits]);
+    if (nbits > 0)
+        putBits(out, (diff < 0 ? diff - 1 : diff) & ((1 << nbits) - 1), nbits);
+
+    int run = 0;
+    for (int k = 1; k < 64; k++) {
+        int32_t v = coef[k];
+
+        if (v == 0) {
+            run++;
+            continue;
+        }
+        while (run > 15) {
+            putBits(out, ac->code[0xf0], ac->size[0xf0]);
+            run -= 16;
+        }
+        nbits = magnitude(v);
+        int symbol = (run << 4) | nbits;
+        putBits(out, ac->code[symbol], ac->size[symbol]);
+        putBits(out, (v < 0 ? v - 1 : v) & ((1 << nbits) - 1), nbits);
+        run = 0;
+    }
+    if (run > 0)
+        putBits(out, ac->code[0x00], ac->size[0x00]);
+}
+
+static bool encodeStripe(const SwJpegContext *ctx, uint32_t stripe, SwJpegStripe *out)
+{
+    int16_t blocks[6][64];
+    int32_t lastDc[3] = { 0, 0, 0 };
+    int lumaBlocks = ctx->is420 ? 4 : 2;
+    uint32_t first = stripe * ctx->rowsPerStripe;
+    uint32_t last = first + ctx->rowsPerStripe;
+
+    if (last > ctx->mcuRows)
+        last = ctx->mcuRows;
+
+    for (uint32_t my = first; my < last; my++) {
+        for (uint32_t mx = 0; mx < ctx->mcusPerRow; mx++) {
+            if (out->size - out->len < MAX_MCU_BYTES) {
+                uint32_t size = out->size * 2 + MAX_MCU_BYTES;
+                uint8_t *buf = (uint8_t *)realloc(out->buf, size);
+
+                if (buf == NULL) {
+                    LOGE("%s: failed to grow the stripe buffer to %u", __func__, size);
+                    return false;
+                }
+                out->buf = buf;
+                out->size = size;
+            }
+
+            loadMcu(ctx, mx, my * ctx->mcuHeight, blocks);
+            for (int b = 0; b < lumaBlocks; b++)
+                encodeBlock(ctx, out, blocks[b], 0, &lastDc[0]);
+            encodeBlock(ctx, out, blocks[lumaBlocks], 1, &lastDc[1]);
+            encodeBlock(ctx, out, blocks[lumaBlocks + 1], 1, &lastDc[2]);
+        }
+    }
+    flushBits(out);
+
+    return true;
+}
+
+static void *stripeWorker(void *arg)
+{
+    SwJpegWorker *worker = (SwJpegWorker *)arg;
+    const SwJpegContext *ctx = worker->ctx;
+
+    for (uint32_t s = worker->first; s < ctx->stripes; s += ctx->threads) {
+        if (!encodeStripe(ctx, s, &worker->stripes[s])) {
+            free(worker->stripes[s].buf);
+            worker->stripes[s].buf = NULL;
+            worker->stripes[s].len = 0;
+        }
+    }
+
+    return NULL;
+}
+
+/* bounded writer for the headers around the entropy coded data */
+struct SwJpegWriter {
+    uint8_t     *buf;
+    uint32_t    size;
+    uint32_t    len;
+    bool        overflow;
+};
+
+static void writeBytes(SwJpegWriter *w, const uint8_t *data, uint32_t len)
+{
+    if (w->overflow || w->size - w->len < len) {
+        w->overflow = true;
+        return;
+    }
+    memcpy(w->buf + w->len, data, len);
+    w->len += len;
+}
+
+static void writeByte(SwJpegWriter *w, uint8_t c)
+{
+    writeBytes(w, &c, 1);
+}
+
+static void writeWord(SwJpegWriter *w, uint16_t v)
+{
+    writeByte(w, v >> 8);
+    writeByte(w, v & 0xff);
+}
+
+static void writeMarker(SwJpegWriter *w, uint8_t marker, uint16_t len)
+{
+    writeByte(w, 0xff);
+    writeByte(w, marker);
+    if (len > 0)
+        writeWord(w, len);
+}
+
+static void writeHuffTable(SwJpegWriter *w, uint8_t id, const uint8_t *bits,
+                           const uint8_t *values)
+{
+    int count = 0;
+
+    for (int i = 0; i < 16; i++)
+        count += bits[i];
+    writeByte(w, id);
+    writeBytes(w, bits, 16);
+    writeBytes(w, values, count);
+}
+
+static void writeHeaders(SwJpegWriter *w, const SwJpegContext *ctx)
+{
+    writeMarker(w, 0xd8, 0);                            /* SOI */
+
+    writeMarker(w, 0xdb, 2 + 2 * 65);                   /* DQT */
+    for (int t = 0; t < 2; t++) {
+        writeByte(w, t);
+        for (int k = 0; k < 64; k++)
+            writeByte(w, ctx->quant[t][zigzag[k]]);
+    }
+
+    writeMarker(w, 0xc0, 17);                           /* SOF0 */
+    writeByte(w, 8);
+    writeWord(w, ctx->height);
+    writeWord(w, ctx->width);
+    writeByte(w, 3);
+    writeByte(w, 1);
+    writeByte(w, ctx->is420 ? 0x22 : 0x21);
+    writeByte(w, 0);
+    writeByte(w, 2);
+    writeByte(w, 0x11);
+    writeByte(w, 1);
+    writeByte(w, 3);
+    writeByte(w, 0x11);
+    writeByte(w, 1);
+
+    writeMarker(w, 0xc4, 2 + 4 * 17 + 2 * 12 + 2 * 162); /* DHT */
+    writeHuffTable(w, 0x00, dcLumaBits, dcValues);
+    writeHuffTable(w, 0x10, acLumaBits, acLumaValues);
+    writeHuffTable(w, 0x01, dcChromaBits, dcValues);
+    writeHuffTable(w, 0x11, acChromaBits, acChromaValues);
+
+    if (ctx->stripes > 1) {
+        writeMarker(w, 0xdd, 4);                        /* DRI */
+        writeWord(w, ctx->rowsPerStripe * ctx->mcusPerRow);
+    }
+
+    writeMarker(w, 0xda, 12);                           /* SOS */
+    writeByte(w, 3);
+    writeByte(w, 1);
+    writeByte(w, 0x00);
+    writeByte(w, 2);
+    writeByte(w, 0x11);
+    writeByte(w, 3);
+    writeByte(w, 0x11);
+    writeByte(w, 0);
+    writeByte(w, 63);
+    writeByte(w, 0);
+}
+
+jpg_return_status swJpegEncode(const uint8_t *src, uint32_t width, uint32_t height,
+                               uint32_t stride, sample_mode_t sampleMode, int quality,
+                               uint8_t *dst, uint32_t dstSize, uint32_t *fileSize)
+{
+    SwJpegContext *ctx;
+    SwJpegStripe *stripes;
+    SwJpegWorker workers[MAX_SW_THREADS];
+    pthread_t threads[MAX_SW_THREADS];
+    jpg_return_status ret = JPG_FAIL;
+
+    if (width == 0 || height == 0 || width > 0xffff || height > 0xffff ||
+            width % 2 != 0 || stride < width * 2) {
+        LOGE("%s: invalid size %ux%u stride %u", __func__, width, height, stride);
+        return JPG_FAIL;
+    }
+    if (sampleMode != JPG_422 && sampleMode != JPG_420) {
+        LOGE("%s: unsupported sample mode %d", __func__, sampleMode);
+        return JPG_FAIL;
+    }
+    if (quality < 1)
+        quality = 1;
+    if (quality > 100)
+        quality = 100;
+
+    /* the tables make the context too large for the stack */
+    ctx = new SwJpegContext;
+    ctx->src = src;
+    ctx->width = width;
+    ctx->height = height;
+    ctx->stride = stride;
+    ctx->is420 = sampleMode == JPG_420;
+    ctx->mcuHeight = ctx->is420 ? 16 : 8;
+    ctx->mcusPerRow = (width + 15) / 16;
+    ctx->mcuRows = (height + ctx->mcuHeight - 1) / ctx->mcuHeight;
+
+    buildQuantTable(lumaQuant, quality, ctx->quant[0], ctx->recip[0]);
+    buildQuantTable(chromaQuant, quality, ctx->quant[1], ctx->recip[1]);
+    buildHuffTable(dcLumaBits, dcValues, &ctx->dc[0]);
+    buildHuffTable(acLumaBits, acLumaValues, &ctx->ac[0]);
+    buildHuffTable(dcChromaBits, dcValues, &ctx->dc[1]);
+    buildHuffTable(acChromaBits, acChromaValues, &ctx->ac[1]);
+
+    /* one stripe per core, each a restart interval so they can be coded
+     * independently.  the interval is limited to 16 bits of MCUs.
+     */
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    if (cores < 1)
+        cores = 1;
+    if (cores > MAX_SW_THREADS)
+        cores = MAX_SW_THREADS;
+    if ((uint32_t)cores > ctx->mcuRows)
+        cores = ctx->mcuRows;
+
+    ctx->rowsPerStripe = (ctx->mcuRows + cores - 1) / cores;
+    if (ctx->rowsPerStripe * ctx->mcusPerRow > 0xffff)
+        ctx->rowsPerStripe = 0xffff / ctx->mcusPerRow;
+    ctx->stripes = (ctx->mcuRows + ctx->rowsPerStripe - 1) / ctx->rowsPerStripe;
+    ctx->threads = cores;
+
+    stripes = new SwJpegStripe[ctx->stripes];
+    memset(stripes, 0, ctx->stripes * sizeof(SwJpegStripe));
+
+    uint32_t started = 0;
+    for (uint32_t t = 0; t < ctx->threads; t++) {
+        workers[t].ctx = ctx;
+        workers[t].stripes = stripes;
+        workers[t].first = t;
+    }
+    for (uint32_t t = 1; t < ctx->threads; t++) {
+        if (pthread_create(&threads[t], NULL, stripeWorker, &workers[t]) != 0)
+            break;
+        started++;
+    }
+    /* stripes of threads that didn't start are picked up here */
+    if (started + 1 < ctx->threads) {
+        for (uint32_t t = started + 1; t < ctx->threads; t++)
+            stripeWorker(&workers[t]);
+    }
+    stripeWorker(&workers[0]);
+    for (uint32_t t = 1; t <= started; t++)
+        pthread_join(threads[t], NULL);
+
+    SwJpegWriter w;
+    w.buf = dst;
+    w.size = dstSize;
+    w.len = 0;
+    w.overflow = false;
+
+    writeHeaders(&w, ctx);
+    for (uint32_t s = 0; s < ctx->stripes; s++) {
+        if (stripes[s].buf == NULL)
+            goto out;
+        writeBytes(&w, stripes[s].buf, stripes[s].len);
+        if (s + 1 < ctx->stripes)
+            writeMarker(&w, 0xd0 + (s & 7), 0);         /* RSTn */
+    }
+    writeMarker(&w, 0xd9, 0);                           /* EOI */
+
+    if (w.overflow) {
+        LOGE("%s: output buffer of %u bytes is too small", __func__, dstSize);
+        goto out;
+    }
+
+    *fileSize = w.len;
+    ret = JPG_SUCCESS;
+
+out:
+    for (uint32_t s = 0; s < ctx->stripes; s++)
+        free(stripes[s].buf);
+    delete[] stripes;
+    delete ctx;
+
+    return ret;
+}
+
+}; // namespace android
@@ -0,0 +1,43 @@
+/*
+ * Copyright (C) 2010 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Baseline JPEG encoder running on the CPU.  JpegEncoder falls back to it
+ * when the JPEG block can't be used.
+ */
+#ifndef __SW_JPEG_ENCODER_H__
+#define __SW_JPEG_ENCODER_H__
+
+#include <stdint.h>
+
+#include "JpegEncoder.h"
+
+namespace android {
+
+/* quality factors standing in for the JPEG block's quality levels */
+int swJpegQuality(image_quality_type_t level);
+
+/* encodes a YUYV image of stride bytes per line into dst as a baseline
+ * JPEG with JPG_422 or JPG_420 sampling and IJG scaled tables for quality
+ * (1..100).  the image is cut into restart interval stripes that are
+ * encoded in parallel, one thread per online core.  edges that don't fill
+ * an MCU are padded by repeating the last column and line.
+ */
+jpg_return_status swJpegEncode(const uint8_t *src, uint32_t width, uint32_t height,
+                               uint32_t stride, sample_mode_t sampleMode, int quality,
+                               uint8_t *dst, uint32_t dstSize, uint32_t *fileSize);
+
+}; // namespace android
+
+#endif // __SW_JPEG_ENCODER_H__
@@ -0,0 +1,296 @@
+/*
+ * Copyright (C) 2010 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#define LOG_TAG "YuvConvert"
+
+#include <utils/Log.h>
+#include <string.h>
+
+#if defined(__ARM_NEON__)
+#include <arm_neon.h>
+#endif
+
+#include "YuvConvert.h"
+
+namespace android {
+
+bool yuyvScaleDown_c(const uint8_t *src, uint32_t srcWidth, uint32_t srcHeight,
+                     uint8_t *dst, uint32_t dstWidth, uint32_t dstHeight)
+{
+    int32_t step_x, step_y;
+    int32_t src_y_start_pos, dst_pos, src_pos;
+
+    if (dstWidth % 2 != 0 || dstHeight % 2 != 0) {
+        LOGE("%s: invalid width, height for scaling", __func__);
+        return false;
+    }
+
+    step_x = srcWidth / dstWidth;
+    step_y = srcHeight / dstHeight;
+
+    dst_pos = 0;
+    for (uint32_t y = 0; y < dstHeight; y++) {
+        src_y_start_pos = (y * step_y * (srcWidth * 2));
+
+        for (uint32_t x = 0; x < dstWidth; x += 2) {
+            src_pos = src_y_start_pos + (x * (step_x * 2));
+
+            dst[dst_pos++] = src[src_pos    ];
+            dst[dst_pos++] = src[src_pos + 1];
+            dst[dst_pos++] = src[src_pos + 2];
+            dst[dst_pos++] = src[src_pos + 3];
+        }
+    }
+
+    return true;
+}
+
+bool yuyvToNV21_c(const uint8_t *src, uint8_t *dst, uint32_t width, uint32_t height)
+{
+    int32_t src_y_start_pos, dst_cbcr_pos, dst_pos, src_pos;
+
+    dst_pos = 0;
+    dst_cbcr_pos = width * height;
+    for (uint32_t y = 0; y < height; y++) {
+        src_y_start_pos = (y * (width * 2));
+
+        for (uint32_t x = 0; x < (width * 2); x += 2) {
+            src_pos = src_y_start_pos + x;
+
+            dst[dst_pos++] = src[src_pos];
+        }
+    }
+    for (uint32_t y = 0; y < height; y += 2) {
+        src_y_start_pos = (y * (width * 2));
+
+        for (uint32_t x = 0; x < (width * 2); x += 4) {
+            src_pos = src_y_start_pos + x;
+
+            dst[dst_cbcr_pos++] = src[src_pos + 3];
+            dst[dst_cbcr_pos++] = src[src_pos + 1];
+        }
+    }
+
+    return true;
+}
+
+/* line kernels.  the NEON versions read and write whole vectors and
+ * finish the tail of the line with the scalar code.
+ */
+
+/* YUYV line -> its luma samples (every even byte) */
+static void lumaLine(const uint8_t *src, uint8_t *dst, uint32_t pixels)
+{
+    uint32_t i = 0;
+
+#if defined(__ARM_NEON__)
+    for (; i + 16 <= pixels; i += 16) {
+        uint8x16x2_t v = vld2q_u8(src + i * 2);
+        vst1q_u8(dst + i, v.val[0]);
+    }
+#endif
+    for (; i < pixels; i++)
+        dst[i] = src[i * 2];
+}
+
+/* YUYV line -> interleaved V U, one pair per pixel pair */
+static void chromaLine(const uint8_t *src, uint8_t *dst, uint32_t pairs)
+{
+    uint32_t i = 0;
+
+#if defined(__ARM_NEON__)
+    for (; i + 16 <= pairs; i += 16) {
+        uint8x16x4_t v = vld4q_u8(src + i * 4);
+        uint8x16x2_t vu;
+        vu.val[0] = v.val[3];
+        vu.val[1] = v.val[1];
+        vst2q_u8(dst + i * 2, vu);
+    }
+#endif
+    for (; i < pairs; i++) {
+        dst[i * 2    ] = src[i * 4 + 3];
+        dst[i * 2 + 1] = src[i * 4 + 1];
+    }
+}
+
+/* a YUYV pixel pair is one 32 bit word, so scaling a line is a strided
+ * word gather.  the common 1:1, 2:1 and 4:1 ratios use de-interleaving
+ * loads and keep the first lane.
+ */
+static void scaleLine(const uint8_t *src, uint8_t *dst, uint32_t words, uint32_t step)
+{
+    uint32_t k = 0;
+
+    if (step == 1) {
+        memcpy(dst, src, words * 4);
+        return;
+    }
+
+    if (((uintptr_t)src | (uintptr_t)dst) & 3) {
+        for (; k < words; k++)
+            memcpy(dst + k * 4, src + k * step * 4, 4);
+        return;
+    }
+
+    const uint32_t *s = (const uint32_t *)src;
+    uint32_t *d = (uint32_t *)dst;
+
+#if defined(__ARM_NEON__)
+    if (step == 2) {
+        for (; k + 4 <= words; k += 4) {
+            uint32x4x2_t v = vld2q_u32(s + k * 2);
+            vst1q_u32(d + k, v.val[0]);
+        }
+    } else if (step == 4) {
+        for (; k + 4 <= words; k += 4) {
+            uint32x4x4_t v = vld4q_u32(s + k * 4);
+            vst1q_u32(d + k, v.val[0]);
+        }
+    }
+#endif
+    for (; k < words; k++)
+        d[k] = s[k * step];
+}
+
+bool yuyvScaleDown(const uint8_t *src, uint32_t srcWidth, uint32_t srcHeight,
+                   uint8_t *dst, uint32_t dstWidth, uint32_t dstHeight)
+{
+    if (dstWidth % 2 != 0 || dstHeight % 2 != 0) {
+        LOGE("%s: invalid width, height for scaling", __func__);
+        return false;
+    }
+
+    uint32_t step_x = srcWidth / dstWidth;
+    uint32_t step_y = srcHeight / dstHeight;
+
+    for (uint32_t y = 0; y < dstHeight; y++) {
+        scaleLine(src + y * step_y * srcWidth * 2, dst + y * dstWidth * 2,
+                  dstWidth / 2, step_x);
+    }
+
+    return true;
+}
+
+bool yuyvToNV21(const uint8_t *src, uint8_t *dst, uint32_t width, uint32_t height)
+{
+    uint32_t pairs = (width + 1) / 2;
+    uint8_t *dst_cbcr = dst + width * height;
+
+    /* the image is contiguous on both sides, so luma is a single run */
+    lumaLine(src, dst, width * height);
+
+    for (uint32_t y = 0; y < height; y += 2) {
+        chromaLine(src + y * width * 2, dst_cbcr, pairs);
+        dst_cbcr += pairs * 2;
+    }
+
+    return true;
+}
+
+/* NV21 luma line and its chroma line -> YUYV line */
+static void yuyvLine(const uint8_t *y, const uint8_t *vu, uint8_t *dst, uint32_t pairs)
+{
+    uint32_t i = 0;
+
+#if defined(__ARM_NEON__)
+    for (; i + 16 <= pairs; i += 16) {
+        uint8x16x2_t luma = vld2q_u8(y + i * 2);
+        uint8x16x2_t chroma = vld2q_u8(vu + i * 2);
+        uint8x16x4_t v;
+        v.val[0] = luma.val[0];
+        v.val[1] = chroma.val[1];
+        v.val[2] = luma.val[1];
+        v.val[3] = chroma.val[0];
+        vst4q_u8(dst + i * 4, v);
+    }
+#endif
+    for (; i < pairs; i++) {
+        dst[i * 4    ] = y[i * 2];
+        dst[i * 4 + 1] = vu[i * 2 + 1];
+        dst[i * 4 + 2] = y[i * 2 + 1];
+        dst[i * 4 + 3] = vu[i * 2];
+    }
+}
+
+bool nv21ToYuyv(const uint8_t *src, uint8_t *dst, uint32_t width, uint32_t height)
+{
+    if (width % 2 != 0) {
+        LOGE("%s: invalid width %d", __func__, width);
+        return false;
+    }
+
+    const uint8_t *src_cbcr = src + width * height;
+
+    for (uint32_t y = 0; y < height; y++) {
+        yuyvLine(src + y * width, src_cbcr + (y / 2) * width,
+                 dst + y * width * 2, width / 2);
+    }
+
+    return true;
+}
+
+/* number of source lines handled per band.  a 640 pixel YUYV band is
+ * 20KB, so it is still in the 32KB L1 when the last output touches it.
+ */
+#define POSTVIEW_BAND_LINES     16
+
+bool yuyvPostview(const uint8_t *src, uint32_t width, uint32_t height,
+                  uint8_t *raw, uint8_t *nv21,
+                  uint8_t *thumb, uint32_t thumbWidth, uint32_t thumbHeight)
+{
+    uint32_t line_size = width * 2;
+    uint32_t pairs = (width + 1) / 2;
+    uint32_t step_x = 0, step_y = 0;
+    uint32_t ty = 0;
+
+    if (thumb != NULL) {
+        if (thumbWidth % 2 != 0 || thumbHeight % 2 != 0) {
+            LOGE("%s: invalid width, height for scaling", __func__);
+            return false;
+        }
+        step_x = width / thumbWidth;
+        step_y = height / thumbHeight;
+    }
+
+    for (uint32_t top = 0; top < height; top += POSTVIEW_BAND_LINES) {
+        uint32_t bottom = top + POSTVIEW_BAND_LINES;
+        if (bottom > height)
+            bottom = height;
+
+        const uint8_t *band = src + top * line_size;
+
+        if (raw != NULL)
+            memcpy(raw + top * line_size, band, (bottom - top) * line_size);
+
+        if (nv21 != NULL) {
+            lumaLine(band, nv21 + top * width, (bottom - top) * width);
+            for (uint32_t y = (top + 1) & ~1; y < bottom; y += 2) {
+                chromaLine(src + y * line_size,
+                           nv21 + width * height + (y / 2) * pairs * 2, pairs);
+            }
+        }
+
+        if (thumb != NULL) {
+            for (; ty < thumbHeight && ty * step_y < bottom; ty++) {
+                scaleLine(src + ty * step_y * line_size, thumb + ty * thumbWidth * 2,
+                          thumbWidth / 2, step_x);
+            }
+        }
+    }
+
+    return true;
+}
+
+}; // namespace android
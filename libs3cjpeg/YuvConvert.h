@@ -0,0 +1,58 @@
+/*
+ * Copyright (C) 2010 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * YUV conversion kernels shared by the camera HAL and the JPEG encoder.
+ * The *_c variants are the plain C reference; the unsuffixed entry points
+ * use NEON when the build targets it and produce identical output.
+ */
+#ifndef __YUV_CONVERT_H__
+#define __YUV_CONVERT_H__
+
+#include <stdint.h>
+
+namespace android {
+
+/* Point-sampled downscale of a YUYV (YUV 4:2:2 interleaved) image.
+ * The scale factors are srcWidth / dstWidth and srcHeight / dstHeight,
+ * truncated; dstWidth and dstHeight must be even.
+ */
+bool yuyvScaleDown(const uint8_t *src, uint32_t srcWidth, uint32_t srcHeight,
+                   uint8_t *dst, uint32_t dstWidth, uint32_t dstHeight);
+bool yuyvScaleDown_c(const uint8_t *src, uint32_t srcWidth, uint32_t srcHeight,
+                     uint8_t *dst, uint32_t dstWidth, uint32_t dstHeight);
+
+/* YUYV to NV21 (Y plane followed by interleaved V/U at half resolution).
+ * Chroma is taken from the even source lines.
+ */
+bool yuyvToNV21(const uint8_t *src, uint8_t *dst, uint32_t width, uint32_t height);
+bool yuyvToNV21_c(const uint8_t *src, uint8_t *dst, uint32_t width, uint32_t height);
+
+/* NV21 to YUYV, each chroma line is used for two output lines.
+ * width must be even.
+ */
+bool nv21ToYuyv(const uint8_t *src, uint8_t *dst, uint32_t width, uint32_t height);
+
+/* The camera postview pass in a single sweep over a YUYV image: copies it
+ * to raw, converts it to NV21 into nv21 and scales it into thumb, band by
+ * band so each source line is read while still in cache.  Any of the
+ * destinations may be NULL.
+ */
+bool yuyvPostview(const uint8_t *src, uint32_t width, uint32_t height,
+                  uint8_t *raw, uint8_t *nv21,
+                  uint8_t *thumb, uint32_t thumbWidth, uint32_t thumbHeight);
+
+}; // namespace android
+
+#endif // __YUV_CONVERT_H__